@@ -0,0 +1,309 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace detail::hazard {
+// Hazard pointers for atomic_shared_ptr::borrow, see shared-ptr.cpp. Every
+// thread owns a few slots; a pointer published in one of them is not
+// released by retire() until the slot lets go of it.
+constexpr size_t slots_per_thread = 4;
+
+using slot = std::atomic<const void*>;
+
+// nullptr if all of the thread's slots are taken
+slot* acquire() noexcept;
+void release(slot* s) noexcept;
+
+// drops `n` strong references to `cb` now or, if it is protected, as soon
+// as a later retire finds it isn't anymore
+void retire(control_block<atomic_counting>* cb, size_t n) noexcept;
+} // namespace detail::hazard
+
+// A scoped look at the value of an atomic_shared_ptr, made by borrow(). It
+// holds no reference: it keeps the value alive by keeping the holder it came
+// from from being released. Keep it short and on one thread.
+template <typename T>
+class borrowed_ptr {
+  template <typename U>
+  friend class atomic_shared_ptr;
+
+public:
+  using element_type = typename shared_ptr<T>::element_type;
+
+  borrowed_ptr(borrowed_ptr&& other) noexcept
+      : ptr(std::exchange(other.ptr, nullptr)),
+        hazard(std::exchange(other.hazard, nullptr)),
+        fallback(std::move(other.fallback)) {}
+
+  borrowed_ptr& operator=(borrowed_ptr&&) = delete;
+
+  ~borrowed_ptr() {
+    if (hazard) {
+      detail::hazard::release(hazard);
+    }
+  }
+
+  element_type* get() const noexcept {
+    return ptr;
+  }
+
+  operator bool() const noexcept {
+    return get();
+  }
+
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U& operator*() const noexcept {
+    return *get();
+  }
+
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U* operator->() const noexcept {
+    return get();
+  }
+
+private:
+  borrowed_ptr(element_type* ptr_, detail::hazard::slot* hazard_) noexcept
+      : ptr(ptr_), hazard(hazard_) {}
+
+  // when the thread is out of hazard slots, a plain copy does the job
+  explicit borrowed_ptr(shared_ptr<T> fallback_) noexcept
+      : ptr(fallback_.get()), fallback(std::move(fallback_)) {}
+
+private:
+  element_type* ptr{nullptr};
+  detail::hazard::slot* hazard{nullptr};
+  shared_ptr<T> fallback;
+};
+
+// A shared_ptr<T> that may be loaded and replaced from many threads at once
+// without locks.
+//
+// The value is kept in a holder: a make_shared'ed shared_ptr<T> that is never
+// modified after it is published. The atomic word points to the holder's
+// block and keeps a count of readers in flight in its top 16 bits (split
+// reference counting):
+//
+// * a reader pins the holder by incrementing that count in the same RMW that
+//   reads the pointer, copies the shared_ptr out of it (one increment on the
+//   value's own block) and unpins by decrementing the count again;
+// * the atomic owns `bias` strong references to its holder. A writer that
+//   swaps a holder out hands the count of readers in flight to them (they
+//   find the pointer changed and release one reference each instead of
+//   unpinning) and gives up the rest of the bias. The bias keeps the holder
+//   alive no matter in which order the two sides get there.
+//
+// A pinned holder cannot be freed, so its address cannot come back as a new
+// holder while somebody still compares against it: there is no ABA.
+//
+// borrow() reads without writing to any shared cache line: it publishes the
+// holder in a hazard pointer of its thread and checks the holder is still
+// current. Writers hand their bias over to detail::hazard::retire, which
+// keeps it while a hazard pointer protects the holder.
+template <typename T>
+class atomic_shared_ptr {
+  using value_type = shared_ptr<T>;
+  using holder_block = detail::obj_block<value_type, std::allocator<value_type>,
+                                         atomic_counting>;
+  using access = detail::shared_ptr_access;
+
+  static_assert(sizeof(void*) == sizeof(uint64_t),
+                "the reader count lives in the unused top bits of a pointer");
+
+public:
+  static constexpr bool is_always_lock_free =
+      std::atomic<uintptr_t>::is_always_lock_free;
+
+  atomic_shared_ptr() noexcept = default;
+
+  atomic_shared_ptr(value_type desired) : word(make_word(std::move(desired))) {}
+
+  atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+  atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+
+  ~atomic_shared_ptr() {
+    // nobody can be reading anymore
+    if (holder_block* h = holder_of(word.load(std::memory_order_acquire))) {
+      retire(h, bias);
+    }
+  }
+
+  atomic_shared_ptr& operator=(value_type desired) {
+    store(std::move(desired));
+    return *this;
+  }
+
+  operator value_type() const {
+    return load();
+  }
+
+  bool is_lock_free() const noexcept {
+    return word.is_lock_free();
+  }
+
+  value_type load() const {
+    uintptr_t cur = word.fetch_add(local_one, std::memory_order_acquire);
+    holder_block* h = holder_of(cur);
+    if (!h) {
+      unpin(h);
+      return value_type();
+    }
+    value_type result = *h->get();
+    unpin(h);
+    return result;
+  }
+
+  // The current value, for as long as the result lives, without touching
+  // its reference counts
+  borrowed_ptr<T> borrow() const {
+    detail::hazard::slot* s = detail::hazard::acquire();
+    if (!s) {
+      return borrowed_ptr<T>(load());
+    }
+    holder_block* h = holder_of(word.load(std::memory_order_relaxed));
+    for (;;) {
+      // the address retire() is handed. seq_cst store and load pair with
+      // the fence in retire: either the writer sees our hazard or we see
+      // its new holder
+      s->store(static_cast<detail::control_block<atomic_counting>*>(h),
+               std::memory_order_seq_cst);
+      holder_block* now = holder_of(word.load(std::memory_order_seq_cst));
+      if (now == h) {
+        break;
+      }
+      h = now;
+    }
+    return borrowed_ptr<T>(h ? h->get()->get() : nullptr, s);
+  }
+
+  void store(value_type desired) {
+    exchange(std::move(desired));
+  }
+
+  value_type exchange(value_type desired) {
+    uintptr_t old =
+        word.exchange(make_word(std::move(desired)), std::memory_order_acq_rel);
+    holder_block* h = holder_of(old);
+    if (!h) {
+      return value_type();
+    }
+    // the holder stays alive until we drop the bias, and nobody modifies it
+    value_type result = *h->get();
+    retire(h, bias - local_of(old));
+    return result;
+  }
+
+  // Succeeds if the current value owns the same block and stores the same
+  // pointer as `expected`; otherwise loads the current value into `expected`.
+  bool compare_exchange_strong(value_type& expected, value_type desired) {
+    uintptr_t desired_word = 0;
+    bool made = false;
+    for (;;) {
+      uintptr_t cur = word.fetch_add(local_one, std::memory_order_acquire);
+      holder_block* h = holder_of(cur);
+      if (!same(h, expected)) {
+        expected = h ? *h->get() : value_type();
+        unpin(h);
+        if (made) {
+          drop_word(desired_word);
+        }
+        return false;
+      }
+      if (!made) {
+        desired_word = make_word(std::move(desired));
+        made = true;
+      }
+      // try to swap the holder out together with all the pins on it,
+      // ours included
+      cur = word.load(std::memory_order_relaxed);
+      while (holder_of(cur) == h) {
+        if (word.compare_exchange_weak(cur, desired_word,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+          if (h) {
+            // the bias, minus the other readers' pins, plus our own pin
+            retire(h, bias - local_of(cur) + 1);
+          }
+          return true;
+        }
+      }
+      // somebody else replaced the holder first and credited our pin
+      if (h) {
+        h->dec_strong();
+      }
+    }
+  }
+
+  bool compare_exchange_weak(value_type& expected, value_type desired) {
+    return compare_exchange_strong(expected, std::move(desired));
+  }
+
+private:
+  static constexpr unsigned local_shift = 48;
+  static constexpr uintptr_t local_one = uintptr_t{1} << local_shift;
+  static constexpr uintptr_t pointer_mask = local_one - 1;
+  // more than the number of readers that can be in flight at once
+  static constexpr size_t bias = size_t{1} << (64 - local_shift);
+
+  static holder_block* holder_of(uintptr_t w) noexcept {
+    return reinterpret_cast<holder_block*>(w & pointer_mask);
+  }
+
+  static size_t local_of(uintptr_t w) noexcept {
+    return static_cast<size_t>(w >> local_shift);
+  }
+
+  static bool same(holder_block* h, const value_type& expected) noexcept {
+    if (!h) {
+      return !access::block(expected) && !expected.get();
+    }
+    const value_type& cur = *h->get();
+    return access::block(cur) == access::block(expected) &&
+           cur.get() == expected.get();
+  }
+
+  static uintptr_t make_word(value_type value) {
+    if (!access::block(value) && !value.get()) {
+      return 0;
+    }
+    auto* h = detail::new_block<holder_block>(std::allocator<value_type>(),
+                                              std::move(value));
+    h->inc_strong(bias - 1);
+    auto w = reinterpret_cast<uintptr_t>(h);
+    assert((w & ~pointer_mask) == 0);
+    return w;
+  }
+
+  // gives up references to a holder that is not current anymore
+  static void retire(holder_block* h, size_t n) noexcept {
+    detail::hazard::retire(h, n);
+  }
+
+  static void drop_word(uintptr_t w) noexcept {
+    if (holder_block* h = holder_of(w)) {
+      h->dec_strong(bias);
+    }
+  }
+
+  // gives back the pin taken on `h`
+  void unpin(holder_block* h) const noexcept {
+    uintptr_t cur = word.load(std::memory_order_relaxed);
+    while (holder_of(cur) == h && local_of(cur) != 0) {
+      if (word.compare_exchange_weak(cur, cur - local_one,
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed)) {
+        return;
+      }
+    }
+    // the holder was swapped out and the writer turned our pin into a strong
+    // reference
+    if (h) {
+      h->dec_strong();
+    }
+  }
+
+private:
+  mutable std::atomic<uintptr_t> word{0};
+};
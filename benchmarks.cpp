@@ -0,0 +1,241 @@
+#include "atomic-shared-ptr.h"
+#include "local-ref.h"
+#include "shared-ptr-ranges.h"
+#include "shared-ptr.h"
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <vector>
+
+namespace {
+
+// Every benchmark runs against each of these, so results can be compared
+// head to head
+struct ours {
+  template <typename T>
+  using shared = shared_ptr<T>;
+  template <typename T>
+  using weak = weak_ptr<T>;
+
+  template <typename T, typename... Args>
+  static shared<T> make(Args&&... args) {
+    return make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+struct ours_local {
+  template <typename T>
+  using shared = local_shared_ptr<T>;
+  template <typename T>
+  using weak = local_weak_ptr<T>;
+
+  template <typename T, typename... Args>
+  static shared<T> make(Args&&... args) {
+    return make_local_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+struct standard {
+  template <typename T>
+  using shared = std::shared_ptr<T>;
+  template <typename T>
+  using weak = std::weak_ptr<T>;
+
+  template <typename T, typename... Args>
+  static shared<T> make(Args&&... args) {
+    return std::make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+template <typename Lib>
+void copy(benchmark::State& state) {
+  auto p = Lib::template make<int>(42);
+  for (auto _ : state) {
+    typename Lib::template shared<int> q = p;
+    benchmark::DoNotOptimize(q);
+  }
+}
+
+template <typename Lib>
+void move(benchmark::State& state) {
+  auto p = Lib::template make<int>(42);
+  for (auto _ : state) {
+    typename Lib::template shared<int> q = std::move(p);
+    benchmark::DoNotOptimize(q);
+    p = std::move(q);
+  }
+}
+
+// the copies are made untimed a batch at a time, so that pausing the timer
+// costs little next to the destructions; the rate is per destruction
+template <typename Lib>
+void destroy(benchmark::State& state) {
+  constexpr size_t batch = 1024;
+  auto p = Lib::template make<int>(42);
+  std::vector<typename Lib::template shared<int>> copies;
+  copies.reserve(batch);
+  for (auto _ : state) {
+    state.PauseTiming();
+    copies.assign(batch, p);
+    state.ResumeTiming();
+    copies.clear();
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+template <typename Lib>
+void weak_lock(benchmark::State& state) {
+  auto p = Lib::template make<int>(42);
+  typename Lib::template weak<int> w = p;
+  for (auto _ : state) {
+    auto q = w.lock();
+    benchmark::DoNotOptimize(q);
+  }
+}
+
+template <typename Lib>
+void make(benchmark::State& state) {
+  for (auto _ : state) {
+    auto p = Lib::template make<int>(42);
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+template <typename Lib>
+void from_new(benchmark::State& state) {
+  for (auto _ : state) {
+    typename Lib::template shared<int> p(new int(42));
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+// all the threads copy the same pointer, so they fight over one block
+template <typename Lib>
+void contended_copy(benchmark::State& state) {
+  static typename Lib::template shared<int> p;
+  if (state.thread_index() == 0) {
+    p = Lib::template make<int>(42);
+  }
+  for (auto _ : state) {
+    typename Lib::template shared<int> q = p;
+    benchmark::DoNotOptimize(q);
+  }
+  if (state.thread_index() == 0) {
+    p = typename Lib::template shared<int>();
+  }
+}
+
+// a vector of pointers to a handful of blocks, copied out element by element
+// and with copy_shared
+std::vector<shared_ptr<int>> fan_out_source() {
+  std::vector<shared_ptr<int>> blocks;
+  for (int i = 0; i != 4; ++i) {
+    blocks.push_back(make_shared<int>(i));
+  }
+  std::vector<shared_ptr<int>> v;
+  for (int i = 0; i != 1024; ++i) {
+    v.push_back(blocks[i % blocks.size()]);
+  }
+  return v;
+}
+
+void fan_out_copy(benchmark::State& state) {
+  auto v = fan_out_source();
+  std::vector<shared_ptr<int>> copy;
+  copy.reserve(v.size());
+  for (auto _ : state) {
+    copy.assign(v.begin(), v.end());
+    copy.clear();
+  }
+}
+
+void fan_out_copy_shared(benchmark::State& state) {
+  auto v = fan_out_source();
+  std::vector<shared_ptr<int>> copy;
+  copy.reserve(v.size());
+  for (auto _ : state) {
+    copy_shared(v.begin(), v.end(), std::back_inserter(copy));
+    release_shared(copy.begin(), copy.end());
+    copy.clear();
+  }
+}
+
+// moving a vector's worth of pointers to new storage, as when it grows: by
+// moves and destructor calls, and as one memcpy
+template <bool Trivially>
+void relocate(benchmark::State& state) {
+  std::allocator<shared_ptr<int>> alloc;
+  constexpr size_t n = 1024;
+  shared_ptr<int>* from = alloc.allocate(n);
+  shared_ptr<int>* to = alloc.allocate(n);
+  std::uninitialized_fill_n(from, n, make_shared<int>(42));
+  for (auto _ : state) {
+    if constexpr (Trivially) {
+      uninitialized_relocate(from, from + n, to);
+    } else {
+      std::uninitialized_move(from, from + n, to);
+      std::destroy(from, from + n);
+    }
+    std::swap(from, to);
+    benchmark::DoNotOptimize(from);
+  }
+  std::destroy(from, from + n);
+  alloc.deallocate(from, n);
+  alloc.deallocate(to, n);
+}
+
+// copies within one thread, next to the shared_ptr copy benchmark above
+void local_ref_copy(benchmark::State& state) {
+  local_ref<int> r(make_shared<int>(42));
+  for (auto _ : state) {
+    local_ref<int> q = r;
+    benchmark::DoNotOptimize(q);
+  }
+}
+
+// readers of one published pointer: a copy with its counts, and a borrow
+atomic_shared_ptr<int>& published() {
+  static atomic_shared_ptr<int> p(make_shared<int>(42));
+  return p;
+}
+
+void atomic_load(benchmark::State& state) {
+  for (auto _ : state) {
+    auto p = published().load();
+    benchmark::DoNotOptimize(*p);
+  }
+}
+
+void atomic_borrow(benchmark::State& state) {
+  for (auto _ : state) {
+    auto p = published().borrow();
+    benchmark::DoNotOptimize(*p);
+  }
+}
+
+} // namespace
+
+#define SHARED_PTR_BENCHMARK(name)                                             \
+  BENCHMARK_TEMPLATE(name, ours);                                              \
+  BENCHMARK_TEMPLATE(name, ours_local);                                        \
+  BENCHMARK_TEMPLATE(name, standard)
+
+SHARED_PTR_BENCHMARK(copy);
+SHARED_PTR_BENCHMARK(move);
+SHARED_PTR_BENCHMARK(destroy);
+SHARED_PTR_BENCHMARK(weak_lock);
+SHARED_PTR_BENCHMARK(make);
+SHARED_PTR_BENCHMARK(from_new);
+
+BENCHMARK_TEMPLATE(contended_copy, ours)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_TEMPLATE(contended_copy, standard)->ThreadRange(1, 16)->UseRealTime();
+
+BENCHMARK_TEMPLATE(relocate, false);
+BENCHMARK_TEMPLATE(relocate, true);
+BENCHMARK(local_ref_copy);
+BENCHMARK(atomic_load)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(atomic_borrow)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(fan_out_copy);
+BENCHMARK(fan_out_copy_shared);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+// A shared_ptr to an object made by make_shared, a single pointer wide: the
+// object lives at a fixed offset in its block, so the block pointer is all
+// there is to store. Made by make_compact_shared or from any shared_ptr that
+// owns (and points to) a make_shared object, and converts back to
+// shared_ptr/weak_ptr sharing the same counts.
+template <typename T, typename Policy = atomic_counting>
+class SHARED_PTR_TRIVIAL_ABI compact_shared_ptr {
+  static_assert(!std::is_array_v<T>, "arrays have no fixed place in a block");
+
+  using access = detail::shared_ptr_access;
+  // what make_shared<T, Policy> allocates
+  using block_type =
+      detail::obj_block<T, detail::default_block_allocator<T>, Policy>;
+
+public:
+  constexpr compact_shared_ptr() noexcept = default;
+
+  constexpr compact_shared_ptr(std::nullptr_t) noexcept {}
+
+  // Whether `p` can be represented: it came from make_shared<T, Policy> and
+  // points to the object it owns
+  static bool fits(const shared_ptr<T, Policy>& p) noexcept {
+    auto* cb = access::block(p);
+    return cb && block_type::is_same_type(cb) &&
+           static_cast<block_type*>(cb)->get() == p.get();
+  }
+
+  // shares ownership with `p`, which has to fit()
+  explicit compact_shared_ptr(const shared_ptr<T, Policy>& p) noexcept
+      : block(checked(p)) {
+    safe_inc();
+  }
+
+  // takes over the reference of `p`, which has to fit()
+  explicit compact_shared_ptr(shared_ptr<T, Policy>&& p) noexcept
+      : block(checked(p)) {
+    access::release(p);
+  }
+
+  compact_shared_ptr(const compact_shared_ptr& other) noexcept
+      : block(other.block) {
+    safe_inc();
+  }
+
+  compact_shared_ptr(compact_shared_ptr&& other) noexcept
+      : block(std::exchange(other.block, nullptr)) {}
+
+  compact_shared_ptr& operator=(const compact_shared_ptr& other) noexcept {
+    compact_shared_ptr tmp(other);
+    swap(tmp);
+    return *this;
+  }
+
+  compact_shared_ptr& operator=(compact_shared_ptr&& other) noexcept {
+    compact_shared_ptr tmp(std::move(other));
+    swap(tmp);
+    return *this;
+  }
+
+  ~compact_shared_ptr() {
+    reset();
+  }
+
+  friend bool operator==(const compact_shared_ptr& lhs,
+                         const compact_shared_ptr& rhs) noexcept {
+    return lhs.block == rhs.block;
+  }
+
+  friend bool operator!=(const compact_shared_ptr& lhs,
+                         const compact_shared_ptr& rhs) noexcept {
+    return lhs.block != rhs.block;
+  }
+
+  T* get() const noexcept {
+    return block ? block->get() : nullptr;
+  }
+
+  operator bool() const noexcept {
+    return block;
+  }
+
+  T& operator*() const noexcept {
+    return *block->get();
+  }
+
+  T* operator->() const noexcept {
+    return block->get();
+  }
+
+  std::size_t use_count() const noexcept {
+    return block ? block->get_strong() : 0;
+  }
+
+  shared_ptr<T, Policy> to_shared() const noexcept {
+    safe_inc();
+    return access::adopt<T>(block, get());
+  }
+
+  weak_ptr<T, Policy> to_weak() const noexcept {
+    return access::make_weak<T>(block, get());
+  }
+
+  void reset() noexcept {
+    if (block) {
+      block->dec_strong();
+      block = nullptr;
+    }
+  }
+
+  void swap(compact_shared_ptr& other) noexcept {
+    std::swap(block, other.block);
+  }
+
+  friend void swap(compact_shared_ptr& lhs, compact_shared_ptr& rhs) noexcept {
+    lhs.swap(rhs);
+  }
+
+private:
+  static block_type* checked(const shared_ptr<T, Policy>& p) noexcept {
+    assert(!access::block(p) || fits(p));
+    return static_cast<block_type*>(access::block(p));
+  }
+
+  void safe_inc() const noexcept {
+    if (block) {
+      block->inc_strong();
+    }
+  }
+
+private:
+  block_type* block{nullptr};
+};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<compact_shared_ptr<T, Policy>>
+    : std::true_type {};
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+compact_shared_ptr<T, Policy> make_compact_shared(Args&&... args) {
+  return compact_shared_ptr<T, Policy>(
+      make_shared<T, Policy>(std::forward<Args>(args)...));
+}
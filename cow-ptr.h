@@ -0,0 +1,93 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+// A copy-on-write handle: copies share one T, and write() hands out a
+// mutable reference only to a handle that is the sole owner, cloning the
+// object first otherwise. A single owner editing over and over mutates in
+// place with no allocation; readers take snapshot()s, which write() never
+// modifies.
+//
+// Any other reference counts as sharing, weak_ptrs included: one could be
+// locked while the object is being modified. So objects deriving from
+// enable_shared_from_this are cloned on every write().
+template <typename T, typename Policy = atomic_counting>
+class SHARED_PTR_TRIVIAL_ABI cow_ptr {
+  static_assert(!std::is_array_v<T>, "clones are made by copying a T");
+
+  using access = detail::shared_ptr_access;
+
+public:
+  constexpr cow_ptr() noexcept = default;
+
+  constexpr cow_ptr(std::nullptr_t) noexcept {}
+
+  // takes over `p`, whose object is modified in place while nobody else
+  // refers to it
+  explicit cow_ptr(shared_ptr<T, Policy> p) noexcept : ptr(std::move(p)) {}
+
+  friend bool operator==(const cow_ptr& lhs, const cow_ptr& rhs) noexcept {
+    return lhs.ptr == rhs.ptr;
+  }
+
+  friend bool operator!=(const cow_ptr& lhs, const cow_ptr& rhs) noexcept {
+    return lhs.ptr != rhs.ptr;
+  }
+
+  const T* get() const noexcept {
+    return ptr.get();
+  }
+
+  operator bool() const noexcept {
+    return get();
+  }
+
+  const T& operator*() const noexcept {
+    return *get();
+  }
+
+  const T* operator->() const noexcept {
+    return get();
+  }
+
+  // whether write() would modify the object in place
+  bool unique() const noexcept {
+    auto* cb = access::block(ptr);
+    return cb && cb->is_unique();
+  }
+
+  // The object, to modify: a copy of it first unless this handle is its
+  // only owner. Other handles and snapshots keep seeing the old value.
+  T& write() {
+    assert(ptr && "nothing to write to");
+    if (!unique()) {
+      ptr = make_shared<T, Policy>(std::as_const(*ptr));
+    }
+    return *ptr;
+  }
+
+  // an immutable view of the current value, which later write()s leave as is
+  shared_ptr<const T, Policy> snapshot() const noexcept {
+    return ptr;
+  }
+
+  void reset() noexcept {
+    ptr.reset();
+  }
+
+  void swap(cow_ptr& other) noexcept {
+    ptr.swap(other.ptr);
+  }
+
+private:
+  shared_ptr<T, Policy> ptr;
+};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<cow_ptr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+cow_ptr<T, Policy> make_cow(Args&&... args) {
+  return cow_ptr<T, Policy>(
+      make_shared<T, Policy>(std::forward<Args>(args)...));
+}
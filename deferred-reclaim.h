@@ -0,0 +1,229 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Deferred reclamation: the last shared_ptr to an object made by
+// make_shared_deferred, or owned with a deferred_delete deleter, does not run
+// the object's destructor, it pushes the object onto a reclaimer's queue, one
+// CAS with no allocation (the queue node is made together with the pointer).
+// The destructors then run in batches, whenever the reclaimer is drained:
+// explicitly at epoch boundaries of the program's choosing, or every so often
+// from a background thread.
+//
+// Only the object is deferred; the control block itself goes away once the
+// weak_ptrs are gone too, and the destructor has run.
+
+namespace detail {
+struct deferred_node {
+  deferred_node* next{nullptr};
+  void (*run)(deferred_node*) noexcept;
+};
+} // namespace detail
+
+class reclaimer {
+public:
+  reclaimer() noexcept = default;
+
+  reclaimer(const reclaimer&) = delete;
+  reclaimer& operator=(const reclaimer&) = delete;
+
+  // anything still queued is destroyed here
+  ~reclaimer() {
+    stop();
+    while (drain() != 0) {
+    }
+  }
+
+  // Runs the destructors queued so far, returns how many. What they queue
+  // in turn is left for the next call.
+  size_t drain() noexcept {
+    detail::deferred_node* batch = head.exchange(nullptr,
+                                                 std::memory_order_acquire);
+    size_t count = 0;
+    while (batch) {
+      detail::deferred_node* next = batch->next;
+      batch->run(batch);
+      batch = next;
+      ++count;
+    }
+    return count;
+  }
+
+  // Drains every `period` on a thread of its own until stop(). The
+  // releasing threads never wake it up: that would cost them a syscall.
+  void start(std::chrono::milliseconds period = std::chrono::milliseconds(1)) {
+    std::lock_guard lg(mutex);
+    if (worker.joinable()) {
+      return;
+    }
+    stopping = false;
+    worker = std::thread([this, period] {
+      std::unique_lock ul(mutex);
+      while (!stopping) {
+        ul.unlock();
+        drain();
+        ul.lock();
+        wake.wait_for(ul, period, [this] { return stopping; });
+      }
+    });
+  }
+
+  void stop() {
+    std::thread finished;
+    {
+      std::lock_guard lg(mutex);
+      stopping = true;
+      finished = std::move(worker);
+    }
+    wake.notify_all();
+    if (finished.joinable()) {
+      finished.join();
+    }
+  }
+
+  void enqueue(detail::deferred_node* node) noexcept {
+    node->next = head.load(std::memory_order_relaxed);
+    // release: the destructor runs after everything the owners did
+    while (!head.compare_exchange_weak(node->next, node,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+private:
+  std::atomic<detail::deferred_node*> head{nullptr};
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread worker;
+  bool stopping{false};
+};
+
+// Never destroyed, so pointers released during exit still have somewhere to
+// go; drain it before exiting if their destructors matter.
+inline reclaimer& default_reclaimer() {
+  static reclaimer* r = new reclaimer;
+  return *r;
+}
+
+// Deleter handing the object to a reclaimer, which then destroys it with D
+template <typename T, typename D = std::default_delete<T>>
+class deferred_delete {
+  using element = std::remove_extent_t<T>;
+
+  struct node : detail::deferred_node {
+    explicit node(D&& deleter_) : deleter(std::move(deleter_)) {
+      run = &destroy;
+    }
+
+    static void destroy(detail::deferred_node* n) noexcept {
+      auto* self = static_cast<node*>(n);
+      self->deleter(self->ptr);
+      delete self;
+    }
+
+    D deleter;
+    element* ptr{nullptr};
+  };
+
+public:
+  explicit deferred_delete(reclaimer& r_ = default_reclaimer(), D deleter = D())
+      : r(&r_), n(new node(std::move(deleter))) {}
+
+  deferred_delete(deferred_delete&& other) noexcept
+      : r(other.r), n(std::exchange(other.n, nullptr)) {}
+
+  deferred_delete& operator=(deferred_delete&& other) noexcept {
+    std::swap(r, other.r);
+    std::swap(n, other.n);
+    return *this;
+  }
+
+  ~deferred_delete() {
+    delete n;
+  }
+
+  void operator()(element* ptr) noexcept {
+    assert(n && "a deferred_delete hands over one object only");
+    n->ptr = ptr;
+    r->enqueue(std::exchange(n, nullptr));
+  }
+
+private:
+  reclaimer* r;
+  node* n;
+};
+
+namespace detail {
+// The object, its control block and its queue node in a single allocation.
+// The block is freed by whichever comes last of the reclaimer running the
+// destructor and the weak_ptrs going away.
+template <typename T, typename Policy>
+class deferred_block : public control_block<Policy>, private deferred_node {
+  using alloc = default_block_allocator<T>;
+
+public:
+  template <typename... Args>
+  deferred_block(const alloc&, reclaimer& r_, Args&&... args)
+      : control_block<Policy>(&manage), r(&r_) {
+    run = &reclaim;
+    ::new (static_cast<void*>(raw())) T(std::forward<Args>(args)...);
+  }
+
+  T* get() noexcept {
+    return reinterpret_cast<T*>(&obj);
+  }
+
+private:
+  static void manage(control_block<Policy>* cb, block_op op) noexcept {
+    auto* self = static_cast<deferred_block*>(cb);
+    if (op == block_op::destroy) {
+      self->release();
+      return;
+    }
+    if (op == block_op::dispose_and_destroy) {
+      // no weak_ptr is left to release its share: nobody can race us here,
+      // and the push publishes the store
+      self->shares.store(1, std::memory_order_relaxed);
+    }
+    self->r->enqueue(self);
+  }
+
+  static void reclaim(deferred_node* n) noexcept {
+    auto* self = static_cast<deferred_block*>(n);
+    std::destroy_at(self->raw());
+    self->release();
+  }
+
+  void release() noexcept {
+    if (shares.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete_block(this, alloc());
+    }
+  }
+
+  std::remove_cv_t<T>* raw() noexcept {
+    return reinterpret_cast<std::remove_cv_t<T>*>(&obj);
+  }
+
+  reclaimer* r;
+  // one for the reclaimer, one for the weak references
+  std::atomic<unsigned> shares{2};
+  std::aligned_storage_t<sizeof(T), alignof(T)> obj;
+};
+} // namespace detail
+
+// A new T whose destructor runs on `r`'s time rather than the last owner's
+template <typename T, typename Policy = atomic_counting, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+make_shared_deferred(reclaimer& r, Args&&... args) {
+  auto* d_block = detail::new_block<detail::deferred_block<T, Policy>>(
+      detail::default_block_allocator<T>(), r, std::forward<Args>(args)...);
+  detail::hook_owner(d_block, d_block->get());
+  return detail::shared_ptr_access::adopt<T>(d_block, d_block->get());
+}
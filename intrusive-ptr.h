@@ -0,0 +1,155 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+// A shared_ptr that is a single pointer wide, for types deriving from
+// intrusive_hook<Policy>: the object itself leads to its control block, so
+// there is nothing else to store. Made by make_intrusive (one allocation for
+// the object and its counts) or from any shared_ptr owning such an object,
+// and converts back to shared_ptr/weak_ptr sharing the same counts.
+template <typename T, typename Policy = atomic_counting>
+class SHARED_PTR_TRIVIAL_ABI intrusive_ptr {
+  static_assert(std::is_base_of_v<intrusive_hook<Policy>, T>,
+                "T has to derive from intrusive_hook<Policy>");
+
+  using block_type = detail::control_block<Policy>;
+  using access = detail::shared_ptr_access;
+
+  template <typename Y, typename P>
+  friend class intrusive_ptr;
+
+public:
+  constexpr intrusive_ptr() noexcept = default;
+
+  constexpr intrusive_ptr(std::nullptr_t) noexcept {}
+
+  // shares ownership of `ptr_`, which must already be owned by a shared_ptr
+  explicit intrusive_ptr(T* ptr_) noexcept : ptr(ptr_) {
+    assert(!ptr || block());
+    safe_inc();
+  }
+
+  explicit intrusive_ptr(const shared_ptr<T, Policy>& other) noexcept
+      : intrusive_ptr(other.get()) {}
+
+  // takes over the reference of `other`, unless it is an alias
+  explicit intrusive_ptr(shared_ptr<T, Policy>&& other) noexcept
+      : ptr(other.get()) {
+    assert(!ptr || block());
+    if (ptr && access::block(other) == block()) {
+      access::release(other);
+    } else {
+      safe_inc();
+    }
+  }
+
+  intrusive_ptr(const intrusive_ptr& other) noexcept : ptr(other.ptr) {
+    safe_inc();
+  }
+
+  intrusive_ptr(intrusive_ptr&& other) noexcept : ptr(other.ptr) {
+    other.ptr = nullptr;
+  }
+
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  intrusive_ptr(const intrusive_ptr<Y, Policy>& other) noexcept
+      : ptr(other.ptr) {
+    safe_inc();
+  }
+
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  intrusive_ptr(intrusive_ptr<Y, Policy>&& other) noexcept : ptr(other.ptr) {
+    other.ptr = nullptr;
+  }
+
+  intrusive_ptr& operator=(const intrusive_ptr& other) noexcept {
+    intrusive_ptr tmp(other);
+    swap(tmp);
+    return *this;
+  }
+
+  intrusive_ptr& operator=(intrusive_ptr&& other) noexcept {
+    intrusive_ptr tmp(std::move(other));
+    swap(tmp);
+    return *this;
+  }
+
+  ~intrusive_ptr() {
+    reset();
+  }
+
+  friend bool operator==(const intrusive_ptr& lhs,
+                         const intrusive_ptr& rhs) noexcept {
+    return lhs.ptr == rhs.ptr;
+  }
+
+  friend bool operator!=(const intrusive_ptr& lhs,
+                         const intrusive_ptr& rhs) noexcept {
+    return lhs.ptr != rhs.ptr;
+  }
+
+  T* get() const noexcept {
+    return ptr;
+  }
+
+  operator bool() const noexcept {
+    return get();
+  }
+
+  T& operator*() const noexcept {
+    return *get();
+  }
+
+  T* operator->() const noexcept {
+    return get();
+  }
+
+  std::size_t use_count() const noexcept {
+    return ptr ? block()->get_strong() : 0;
+  }
+
+  shared_ptr<T, Policy> to_shared() const noexcept {
+    safe_inc();
+    return access::adopt<T>(ptr ? block() : nullptr, ptr);
+  }
+
+  weak_ptr<T, Policy> to_weak() const noexcept {
+    return access::make_weak<T>(ptr ? block() : nullptr, ptr);
+  }
+
+  void reset() noexcept {
+    if (ptr) {
+      block()->dec_strong();
+      ptr = nullptr;
+    }
+  }
+
+  void swap(intrusive_ptr& other) noexcept {
+    std::swap(ptr, other.ptr);
+  }
+
+private:
+  block_type* block() const noexcept {
+    return access::block(static_cast<const intrusive_hook<Policy>*>(ptr));
+  }
+
+  void safe_inc() const noexcept {
+    if (ptr) {
+      block()->inc_strong();
+    }
+  }
+
+private:
+  T* ptr{nullptr};
+};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<intrusive_ptr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+intrusive_ptr<T, Policy> make_intrusive(Args&&... args) {
+  return intrusive_ptr<T, Policy>(
+      make_shared<T, Policy>(std::forward<Args>(args)...));
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+// A shared_ptr for copying around within one thread. All the local_refs
+// copied from one another hold a single strong reference of the shared
+// block between them and keep their own count of it with plain arithmetic:
+// copies and releases touch no atomics, only the first local_ref and the
+// last one's destruction do. share() makes a real shared_ptr to hand over
+// to another thread.
+//
+// A local_ref and its copies must stay on the thread that made them; pass
+// what share() returns instead.
+template <typename T, typename Policy = atomic_counting>
+class SHARED_PTR_TRIVIAL_ABI local_ref {
+  using record = local_shared_ptr<shared_ptr<T, Policy>>;
+
+public:
+  using element_type = typename shared_ptr<T, Policy>::element_type;
+
+  constexpr local_ref() noexcept = default;
+
+  constexpr local_ref(std::nullptr_t) noexcept {}
+
+  // takes over the reference of `p`
+  explicit local_ref(shared_ptr<T, Policy> p)
+      : ptr(p.get()), rec(make_local_shared<shared_ptr<T, Policy>>(
+                          std::move(p))) {}
+
+  local_ref(const local_ref&) noexcept = default;
+  local_ref(local_ref&&) noexcept = default;
+  local_ref& operator=(const local_ref&) noexcept = default;
+  local_ref& operator=(local_ref&&) noexcept = default;
+
+  friend bool operator==(const local_ref& lhs, const local_ref& rhs) noexcept {
+    return lhs.ptr == rhs.ptr;
+  }
+
+  friend bool operator!=(const local_ref& lhs, const local_ref& rhs) noexcept {
+    return lhs.ptr != rhs.ptr;
+  }
+
+  element_type* get() const noexcept {
+    return ptr;
+  }
+
+  operator bool() const noexcept {
+    return get();
+  }
+
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U& operator*() const noexcept {
+    return *get();
+  }
+
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U* operator->() const noexcept {
+    return get();
+  }
+
+  // the number of local_refs sharing this one's reference
+  std::size_t local_count() const noexcept {
+    return rec.use_count();
+  }
+
+  // one more strong reference, which may go to any thread
+  shared_ptr<T, Policy> share() const noexcept {
+    return rec ? *rec : shared_ptr<T, Policy>();
+  }
+
+  void reset() noexcept {
+    ptr = nullptr;
+    rec.reset();
+  }
+
+  void swap(local_ref& other) noexcept {
+    std::swap(ptr, other.ptr);
+    rec.swap(other.rec);
+  }
+
+private:
+  // cached, so that getting at the object is a single load
+  element_type* ptr{nullptr};
+  record rec;
+};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<local_ref<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy = atomic_counting>
+local_ref<T, Policy> make_local_ref(shared_ptr<T, Policy> p) {
+  return local_ref<T, Policy>(std::move(p));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What the refcount instrumentation counted for one concrete control block
+// type (that is, per pointee type, deleter, allocator and counting policy),
+// summed over all threads
+struct refcount_stats {
+  std::string block_type;
+  uint64_t allocations{0};
+  uint64_t frees{0};
+  uint64_t strong_incs{0};
+  uint64_t strong_decs{0};
+  uint64_t weak_incs{0};
+  uint64_t weak_decs{0};
+  uint64_t lock_hits{0};
+  uint64_t lock_misses{0};
+  uint64_t peak_use_count{0};
+};
+
+// Every thread counts into its own table; this adds them up at the time of
+// the call. Empty unless everything was built with SHARED_PTR_INSTRUMENT.
+std::vector<refcount_stats> collect_refcount_stats();
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "shared-ptr.h"
+
+#include <iterator>
+
+// Bulk copies and releases of ranges of shared_ptrs. Elements owned by the
+// same control block have their count changes merged, so a range of n
+// pointers to k different blocks costs about k RMWs rather than n. Blocks
+// are merged within a window of `tally_size` distinct blocks: ranges where
+// the same few blocks keep coming back are the ones that profit.
+
+namespace detail {
+template <typename P>
+struct shared_ptr_traits;
+
+template <typename T, typename Policy>
+struct shared_ptr_traits<shared_ptr<T, Policy>> {
+  using type = T;
+  using policy = Policy;
+};
+
+// Pending reference count changes, per block
+template <typename Policy>
+class block_tally {
+public:
+  static constexpr size_t tally_size = 8;
+
+  // false if `cb` is new and there is no room left for it
+  bool add(control_block<Policy>* cb) noexcept {
+    for (size_t i = 0; i != used; ++i) {
+      if (entries[i].cb == cb) {
+        ++entries[i].count;
+        return true;
+      }
+    }
+    if (used == tally_size) {
+      return false;
+    }
+    entries[used++] = {cb, 1};
+    return true;
+  }
+
+  void apply_inc() noexcept {
+    for (size_t i = 0; i != used; ++i) {
+      entries[i].cb->inc_strong(entries[i].count);
+    }
+    used = 0;
+  }
+
+  void apply_dec() noexcept {
+    for (size_t i = 0; i != used; ++i) {
+      entries[i].cb->dec_strong(entries[i].count);
+    }
+    used = 0;
+  }
+
+private:
+  struct entry {
+    control_block<Policy>* cb;
+    size_t count;
+  };
+
+  entry entries[tally_size];
+  size_t used{0};
+};
+} // namespace detail
+
+// Writes a copy of every pointer in [first, last) to `out`, like std::copy.
+// The references for a window of elements are taken before any of its copies
+// is written, so if writing to `out` throws, the copies already made are
+// complete shared_ptrs and the rest of the window is given back.
+template <typename ForwardIt, typename OutputIt>
+OutputIt copy_shared(ForwardIt first, ForwardIt last, OutputIt out) {
+  using traits = detail::shared_ptr_traits<
+      typename std::iterator_traits<ForwardIt>::value_type>;
+  using T = typename traits::type;
+  using access = detail::shared_ptr_access;
+
+  detail::block_tally<typename traits::policy> tally;
+  while (first != last) {
+    // count the references of as many elements as fit in the tally...
+    ForwardIt window_end = first;
+    for (; window_end != last; ++window_end) {
+      if (auto* cb = access::block(*window_end); cb && !tally.add(cb)) {
+        break;
+      }
+    }
+    tally.apply_inc();
+    // ...then hand each of them to its copy
+    for (; first != window_end; ++first) {
+      auto copy = access::adopt<T>(access::block(*first), first->get());
+      try {
+        *out = std::move(copy);
+      } catch (...) {
+        // `copy` lets go of its own reference; the others are still ours
+        for (++first; first != window_end; ++first) {
+          if (auto* cb = access::block(*first)) {
+            cb->dec_strong();
+          }
+        }
+        throw;
+      }
+      ++out;
+    }
+  }
+  return out;
+}
+
+// Resets every pointer in [first, last), releasing the references of each
+// block in one go
+template <typename ForwardIt>
+void release_shared(ForwardIt first, ForwardIt last) noexcept {
+  using traits = detail::shared_ptr_traits<
+      typename std::iterator_traits<ForwardIt>::value_type>;
+  using access = detail::shared_ptr_access;
+
+  detail::block_tally<typename traits::policy> tally;
+  for (; first != last; ++first) {
+    if (auto* cb = access::block(*first)) {
+      if (!tally.add(cb)) {
+        tally.apply_dec();
+        tally.add(cb);
+      }
+    }
+    access::release(*first);
+  }
+  tally.apply_dec();
+}
@@ -1,31 +1,508 @@
 #include "shared-ptr.h"
+#include "atomic-shared-ptr.h"
+#include "refcount-stats.h"
+
+#include <mutex>
+#include <vector>
+#ifdef SHARED_PTR_INSTRUMENT
+#include <cstdlib>
+#include <unordered_map>
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#endif
+#endif
 
 namespace detail {
-size_t control_block::get_strong() const {
-  return strong_cnt;
+template <typename Policy>
+void control_block<Policy>::dispose() noexcept {
+  manage(this, block_op::dispose);
+}
+
+template <typename Policy>
+void control_block<Policy>::destroy() noexcept {
+  note(stats::event::free);
+  manage(this, block_op::destroy);
+}
+
+template <typename Policy>
+void control_block<Policy>::dispose_and_destroy() noexcept {
+  note(stats::event::free);
+  manage(this, block_op::dispose_and_destroy);
+}
+
+template class control_block<atomic_counting>;
+template class control_block<local_counting>;
+
+// the one release path of all erased deleters, see erased_ptr_block
+template <typename Policy>
+void erased_ptr_block<Policy>::manage(control_block<Policy>* cb,
+                                      block_op op) noexcept {
+  auto* self = static_cast<erased_ptr_block*>(cb);
+  self->invoke(op, self->storage, self->ptr);
+  if (op != block_op::dispose) {
+    delete_block(self, default_block_allocator<erased_ptr_block>());
+  }
 }
 
-void control_block::inc_strong() {
-  strong_cnt++;
-  inc_weak();
+template class erased_ptr_block<atomic_counting>;
+template class erased_ptr_block<local_counting>;
+
+namespace {
+constexpr size_t pool_classes = pool_max_size / pool_granularity;
+// blocks moved between a thread and the global list at once
+constexpr size_t pool_batch = 32;
+
+struct free_node {
+  free_node* next;
+};
+
+struct free_list {
+  void push(free_node* node) noexcept {
+    node->next = head;
+    head = node;
+    ++size;
+  }
+
+  free_node* pop() noexcept {
+    free_node* node = head;
+    head = node->next;
+    --size;
+    return node;
+  }
+
+  // moves up to `n` nodes from the front of `other` to the front of this
+  void take(free_list& other, size_t n) noexcept {
+    for (; n != 0 && other.head; --n) {
+      push(other.pop());
+    }
+  }
+
+  free_node* head{nullptr};
+  size_t size{0};
+};
+
+struct global_pool {
+  std::mutex mutex;
+  free_list lists[pool_classes];
+};
+
+// never destroyed: thread caches may give their blocks back during exit
+global_pool& get_global_pool() {
+  static global_pool* pool = new global_pool;
+  return *pool;
+}
+
+// trivially destructible, so still readable while thread_locals go away:
+// blocks of thread_locals destroyed after the cache go to the global lists
+thread_local bool cache_gone = false;
+
+struct thread_cache {
+  thread_cache() = default;
+  thread_cache(const thread_cache&) = delete;
+  thread_cache& operator=(const thread_cache&) = delete;
+
+  ~thread_cache() {
+    cache_gone = true;
+    global_pool& pool = get_global_pool();
+    std::lock_guard lg(pool.mutex);
+    for (size_t i = 0; i != pool_classes; ++i) {
+      pool.lists[i].take(lists[i], lists[i].size);
+    }
+  }
+
+  free_list lists[pool_classes];
+};
+
+thread_local thread_cache cache;
+
+size_t size_class(size_t size) noexcept {
+  return (size + pool_granularity - 1) / pool_granularity - 1;
 }
 
-void control_block::dec_strong() {
-  strong_cnt--;
-  if (strong_cnt == 0) {
-    delete_data();
+void refill(free_list& list, size_t cls) {
+  global_pool& pool = get_global_pool();
+  {
+    std::lock_guard lg(pool.mutex);
+    list.take(pool.lists[cls], pool_batch);
+  }
+  if (list.head) {
+    return;
+  }
+  // carve a fresh slab; slabs are never given back to the system
+  size_t node_size = (cls + 1) * pool_granularity;
+  auto* slab = static_cast<char*>(::operator new(node_size * pool_batch));
+  for (size_t i = 0; i != pool_batch; ++i) {
+    list.push(reinterpret_cast<free_node*>(slab + i * node_size));
   }
-  dec_weak();
 }
+} // namespace
 
-void control_block::inc_weak() {
-  weak_cnt++;
+void* pool_allocate(size_t size) {
+  size_t cls = size_class(size);
+  if (cache_gone) {
+    global_pool& pool = get_global_pool();
+    std::lock_guard lg(pool.mutex);
+    if (pool.lists[cls].head) {
+      return pool.lists[cls].pop();
+    }
+    // a node of its own, which joins the pool once it is freed
+    return ::operator new((cls + 1) * pool_granularity);
+  }
+  free_list& list = cache.lists[cls];
+  if (!list.head) {
+    refill(list, cls);
+  }
+  return list.pop();
 }
 
-void control_block::dec_weak() {
-  weak_cnt--;
-  if (weak_cnt == 0) {
-    delete this; // call to the virtual destructor
+void pool_deallocate(void* p, size_t size) noexcept {
+  size_t cls = size_class(size);
+  if (cache_gone) {
+    global_pool& pool = get_global_pool();
+    std::lock_guard lg(pool.mutex);
+    pool.lists[cls].push(static_cast<free_node*>(p));
+    return;
+  }
+  free_list& list = cache.lists[cls];
+  list.push(static_cast<free_node*>(p));
+  if (list.size >= 2 * pool_batch) {
+    global_pool& pool = get_global_pool();
+    std::lock_guard lg(pool.mutex);
+    pool.lists[cls].take(list, pool_batch);
   }
 }
 } // namespace detail
+
+namespace detail::hazard {
+namespace {
+// The slots of one thread. Records are never freed: a thread that exits
+// gives its record up for the next new thread to take over.
+struct record {
+  slot slots[slots_per_thread]{};
+  std::atomic<bool> taken{true};
+  record* next{nullptr};
+  // which slots are in use, only ever looked at by the owning thread
+  unsigned used{0};
+};
+
+std::atomic<record*> records{nullptr};
+
+record* take_record() {
+  for (record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+    bool expected = false;
+    if (!r->taken.load(std::memory_order_relaxed) &&
+        r->taken.compare_exchange_strong(expected, true,
+                                         std::memory_order_acquire)) {
+      return r;
+    }
+  }
+  auto* r = new record;
+  r->next = records.load(std::memory_order_relaxed);
+  while (!records.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+  }
+  return r;
+}
+
+struct thread_record {
+  thread_record() : r(take_record()) {}
+
+  thread_record(const thread_record&) = delete;
+  thread_record& operator=(const thread_record&) = delete;
+
+  ~thread_record() {
+    // a borrowed_ptr outliving its thread is a bug of the caller
+    r->used = 0;
+    r->taken.store(false, std::memory_order_release);
+  }
+
+  record* r;
+};
+
+record& this_thread_record() {
+  thread_local thread_record tr;
+  return *tr.r;
+}
+
+bool is_protected(const void* p) noexcept {
+  for (record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+    for (const slot& s : r->slots) {
+      // acquire: a borrower that has let go of `p` is done reading it
+      if (s.load(std::memory_order_acquire) == p) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+struct retired {
+  control_block<atomic_counting>* cb;
+  size_t n;
+};
+
+// references that were still protected when they were retired
+struct retired_list {
+  std::mutex mutex;
+  std::vector<retired> entries;
+  std::atomic<size_t> size{0};
+};
+
+// never destroyed, like the block pool
+retired_list& get_retired() {
+  static retired_list* list = new retired_list;
+  return *list;
+}
+} // namespace
+
+slot* acquire() noexcept {
+  record& r = this_thread_record();
+  for (size_t i = 0; i != slots_per_thread; ++i) {
+    if (!(r.used & (1u << i))) {
+      r.used |= 1u << i;
+      return &r.slots[i];
+    }
+  }
+  return nullptr;
+}
+
+namespace {
+// drops what is not protected anymore, `fresh` included
+void reclaim(retired_list& list, const retired* fresh) noexcept {
+  std::vector<retired> free;
+  {
+    std::lock_guard lg(list.mutex);
+    if (fresh) {
+      list.entries.push_back(*fresh);
+    }
+    auto still_protected = std::partition(
+        list.entries.begin(), list.entries.end(),
+        [](const retired& r) { return is_protected(r.cb); });
+    free.assign(still_protected, list.entries.end());
+    list.entries.erase(still_protected, list.entries.end());
+    list.size.store(list.entries.size(), std::memory_order_relaxed);
+  }
+  // outside the lock: the values' destructors may retire in turn
+  for (const retired& r : free) {
+    r.cb->dec_strong(r.n);
+  }
+}
+} // namespace
+
+void release(slot* s) noexcept {
+  record& r = this_thread_record();
+  s->store(nullptr, std::memory_order_release);
+  r.used &= ~(1u << (s - r.slots));
+  // Borrowers help to release retired holders, so that they need not wait
+  // for the next writer; a plain load when nothing is pending. This may miss
+  // an entry retired just now, which then waits for the next retire or
+  // release.
+  retired_list& list = get_retired();
+  if (list.size.load(std::memory_order_relaxed) != 0) {
+    reclaim(list, nullptr);
+  }
+}
+
+void retire(control_block<atomic_counting>* cb, size_t n) noexcept {
+  // pairs with the fence of a borrower: either it sees the holder has been
+  // replaced, or we see its hazard pointer
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  retired_list& list = get_retired();
+  if (list.size.load(std::memory_order_relaxed) == 0 && !is_protected(cb)) {
+    cb->dec_strong(n);
+    return;
+  }
+  retired fresh{cb, n};
+  reclaim(list, &fresh);
+}
+} // namespace detail::hazard
+
+namespace detail::stats {
+#ifdef SHARED_PTR_INSTRUMENT
+namespace {
+// Counters of one block type on one thread. Only the owning thread writes
+// them, so plain loads and stores do; they are atomic for the collector.
+struct type_counters {
+  std::atomic<const void*> type{nullptr};
+  std::atomic<uint64_t> events[event_count]{};
+  std::atomic<uint64_t> peak_use_count{0};
+};
+
+struct totals {
+  uint64_t events[event_count]{};
+  uint64_t peak_use_count{0};
+
+  void add(const type_counters& c) noexcept {
+    for (size_t i = 0; i != event_count; ++i) {
+      events[i] += c.events[i].load(std::memory_order_relaxed);
+    }
+    peak_use_count = std::max(peak_use_count,
+                              c.peak_use_count.load(std::memory_order_relaxed));
+  }
+};
+
+struct thread_stats;
+
+// never destroyed, like the block pool
+struct registry {
+  std::mutex mutex;
+  std::vector<thread_stats*> threads;
+  // what exited threads counted, and what did not fit in a thread's table
+  std::unordered_map<const void*, totals> retired;
+  std::unordered_map<const void*, const char*> names;
+};
+
+registry& get_registry() {
+  static registry* r = new registry;
+  return *r;
+}
+
+void bump(std::atomic<uint64_t>& counter, uint64_t n) noexcept {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+void record_into(type_counters& c, event e, size_t n,
+                 size_t use_count) noexcept {
+  bump(c.events[static_cast<size_t>(e)], n);
+  if (use_count > c.peak_use_count.load(std::memory_order_relaxed)) {
+    c.peak_use_count.store(use_count, std::memory_order_relaxed);
+  }
+}
+
+// events that cannot go to a thread's own table are counted under the lock
+void record_retired(const void* type, event e, size_t n,
+                    size_t use_count) noexcept {
+  registry& r = get_registry();
+  std::lock_guard lg(r.mutex);
+  totals& t = r.retired[type];
+  t.events[static_cast<size_t>(e)] += n;
+  t.peak_use_count = std::max<uint64_t>(t.peak_use_count, use_count);
+}
+
+struct thread_stats {
+  // open addressing, keys are never removed
+  static constexpr size_t table_size = 256;
+
+  thread_stats() {
+    registry& r = get_registry();
+    std::lock_guard lg(r.mutex);
+    r.threads.push_back(this);
+  }
+
+  thread_stats(const thread_stats&) = delete;
+  thread_stats& operator=(const thread_stats&) = delete;
+
+  ~thread_stats();
+
+  type_counters* find(const void* type) noexcept {
+    size_t start = std::hash<const void*>()(type) % table_size;
+    for (size_t i = 0; i != table_size; ++i) {
+      type_counters& c = table[(start + i) % table_size];
+      const void* key = c.type.load(std::memory_order_relaxed);
+      if (key == type) {
+        return &c;
+      }
+      if (!key) {
+        c.type.store(type, std::memory_order_release);
+        return &c;
+      }
+    }
+    return nullptr;
+  }
+
+  type_counters table[table_size];
+};
+
+// trivially destructible, so still readable while thread_locals go away
+thread_local enum { unused, alive, gone } thread_state = unused;
+
+thread_stats::~thread_stats() {
+  thread_state = gone;
+  registry& r = get_registry();
+  std::lock_guard lg(r.mutex);
+  for (const type_counters& c : table) {
+    if (const void* type = c.type.load(std::memory_order_relaxed)) {
+      r.retired[type].add(c);
+    }
+  }
+  r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+}
+
+thread_stats* this_thread_stats() noexcept {
+  if (thread_state == gone) {
+    return nullptr;
+  }
+  thread_local thread_stats stats;
+  thread_state = alive;
+  return &stats;
+}
+
+std::string demangle(const char* name) {
+#if __has_include(<cxxabi.h>)
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (status == 0) {
+    std::string result(demangled);
+    std::free(demangled);
+    return result;
+  }
+#endif
+  return name;
+}
+} // namespace
+
+void record(const void* type, event e, size_t n, size_t use_count) noexcept {
+  if (thread_stats* stats = this_thread_stats()) {
+    if (type_counters* c = stats->find(type)) {
+      record_into(*c, e, n, use_count);
+      return;
+    }
+  }
+  record_retired(type, e, n, use_count);
+}
+
+void name_type(const void* type, const char* name) noexcept {
+  registry& r = get_registry();
+  std::lock_guard lg(r.mutex);
+  r.names.emplace(type, name);
+}
+#endif
+} // namespace detail::stats
+
+std::vector<refcount_stats> collect_refcount_stats() {
+  std::vector<refcount_stats> result;
+#ifdef SHARED_PTR_INSTRUMENT
+  using namespace detail::stats;
+  registry& r = get_registry();
+  std::unordered_map<const void*, totals> all;
+  std::unordered_map<const void*, const char*> names;
+  {
+    std::lock_guard lg(r.mutex);
+    all = r.retired;
+    for (thread_stats* stats : r.threads) {
+      for (const type_counters& c : stats->table) {
+        if (const void* type = c.type.load(std::memory_order_acquire)) {
+          all[type].add(c);
+        }
+      }
+    }
+    names = r.names;
+  }
+  for (const auto& [type, t] : all) {
+    refcount_stats& s = result.emplace_back();
+    auto name = names.find(type);
+    s.block_type = name != names.end() ? demangle(name->second) : "unknown";
+    s.allocations = t.events[static_cast<size_t>(event::allocation)];
+    s.frees = t.events[static_cast<size_t>(event::free)];
+    s.strong_incs = t.events[static_cast<size_t>(event::strong_inc)];
+    s.strong_decs = t.events[static_cast<size_t>(event::strong_dec)];
+    s.weak_incs = t.events[static_cast<size_t>(event::weak_inc)];
+    s.weak_decs = t.events[static_cast<size_t>(event::weak_dec)];
+    s.lock_hits = t.events[static_cast<size_t>(event::lock_hit)];
+    s.lock_misses = t.events[static_cast<size_t>(event::lock_miss)];
+    s.peak_use_count = t.peak_use_count;
+  }
+#endif
+  return result;
+}
@@ -1,47 +1,428 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <new>
 #include <type_traits>
+#ifdef SHARED_PTR_INSTRUMENT
+#include <typeinfo>
+#endif
 #include <utility>
 
+// Lets the pointer types be passed and returned in registers although they
+// have destructors (clang only). Their members are plain pointers, which
+// stay valid wherever in memory they are moved to.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::trivial_abi)
+#define SHARED_PTR_TRIVIAL_ABI [[clang::trivial_abi]]
+#endif
+#endif
+#ifndef SHARED_PTR_TRIVIAL_ABI
+#define SHARED_PTR_TRIVIAL_ABI
+#endif
+
+namespace detail {
+
+// Drop-in replacement for std::atomic<V> for counters that never leave one
+// thread: same interface, plain arithmetic underneath
+template <typename V>
+class plain_counter {
+public:
+  constexpr plain_counter(V value_) noexcept : value(value_) {}
+
+  V load(std::memory_order = std::memory_order_seq_cst) const noexcept {
+    return value;
+  }
+
+  V fetch_add(V arg, std::memory_order = std::memory_order_seq_cst) noexcept {
+    V old = value;
+    value += arg;
+    return old;
+  }
+
+  V fetch_sub(V arg, std::memory_order = std::memory_order_seq_cst) noexcept {
+    V old = value;
+    value -= arg;
+    return old;
+  }
+
+  bool compare_exchange_weak(V& expected, V desired, std::memory_order,
+                             std::memory_order) noexcept {
+    if (value != expected) {
+      expected = value;
+      return false;
+    }
+    value = desired;
+    return true;
+  }
+
+private:
+  V value;
+};
+} // namespace detail
+
+// Counting policies. `counter<V>` is the type a control block keeps its
+// reference counters in.
+//
+// atomic_counting: copies may cross threads, every count change is a single
+//                  lock-free RMW
+// local_counting:  the pointer and all of its copies stay on one thread,
+//                  every count change is a plain add
+struct atomic_counting {
+  template <typename V>
+  using counter = std::atomic<V>;
+};
+
+struct local_counting {
+  template <typename V>
+  using counter = detail::plain_counter<V>;
+};
+
+namespace detail {
+// Size-class pool for control blocks, see shared-ptr.cpp. Every thread keeps
+// its own free lists and exchanges batches of blocks with a global list, so
+// an allocation or a free is a couple of pointer moves in the common case.
+constexpr size_t pool_granularity = 16;
+constexpr size_t pool_max_size = 256;
+
+void* pool_allocate(size_t size);
+void pool_deallocate(void* p, size_t size) noexcept;
+} // namespace detail
+
+// Allocator handing out single objects (that is, control blocks) from the
+// block pool. Pass it to allocate_shared/shared_ptr(Y*, D, Alloc), or define
+// SHARED_PTR_POOL_BLOCKS (for every translation unit) to make it the default
+// for make_shared and shared_ptr(Y*, D).
+template <typename T>
+class pool_allocator {
+public:
+  using value_type = T;
+
+  pool_allocator() noexcept = default;
+
+  template <typename U>
+  pool_allocator(const pool_allocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    if (!pooled(n)) {
+      return std::allocator<T>().allocate(n);
+    }
+    return static_cast<T*>(detail::pool_allocate(sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) noexcept {
+    if (!pooled(n)) {
+      std::allocator<T>().deallocate(p, n);
+      return;
+    }
+    detail::pool_deallocate(p, sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const pool_allocator<U>&) const noexcept {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const pool_allocator<U>&) const noexcept {
+    return false;
+  }
+
+private:
+  static constexpr bool pooled(size_t n) noexcept {
+    return n == 1 && sizeof(T) <= detail::pool_max_size &&
+           alignof(T) <= detail::pool_granularity;
+  }
+};
+
 namespace detail {
+// The allocators are made for the element type without cv-qualifiers, as
+// allocate_shared requires: std::allocator<const T> does not exist
+template <typename T>
+using allocated_type = std::remove_cv_t<std::remove_all_extents_t<T>>;
+
+#ifdef SHARED_PTR_POOL_BLOCKS
+template <typename T>
+using default_block_allocator = pool_allocator<allocated_type<T>>;
+#else
+template <typename T>
+using default_block_allocator = std::allocator<allocated_type<T>>;
+#endif
 
+// Refcount instrumentation, compiled in by defining SHARED_PTR_INSTRUMENT (for
+// every translation unit, shared-ptr.cpp included); see refcount-stats.h.
+// Events are counted per concrete block type, which a block is told apart by
+// through its `manage` function. Without the macro the hooks are empty.
+namespace stats {
+enum class event {
+  allocation,
+  free,
+  strong_inc,
+  strong_dec,
+  weak_inc,
+  weak_dec,
+  lock_hit,
+  lock_miss,
+};
+constexpr size_t event_count = 8;
+
+#ifdef SHARED_PTR_INSTRUMENT
+// `use_count` is the strong count after the event, 0 if not known
+void record(const void* type, event e, size_t n, size_t use_count) noexcept;
+void name_type(const void* type, const char* name) noexcept;
+
+template <typename Block>
+void name_block(const void* type) noexcept {
+  static const bool named = (name_type(type, typeid(Block).name()), true);
+  (void)named;
+}
+#endif
+} // namespace stats
+
+// What the last reference asks the concrete block to do
+enum class block_op {
+  dispose,             // destroy the managed object
+  destroy,             // free the block itself
+  dispose_and_destroy, // both, for the last reference of any kind
+};
+
+// Reference counting is defined here so that copies and destructions of the
+// pointers compile down to a couple of instructions; only the cold
+// destruction path lives in shared-ptr.cpp.
+//
+// Both counters are packed into a single 64-bit word: the high half is the
+// number of shared_ptrs, the low half is the number of weak_ptrs plus one
+// for all the shared_ptrs together. So a strong copy or release is exactly
+// one RMW, and the block can see "strong == 1 && no weak_ptrs" with a single
+// load. A block is created holding one strong reference.
+//
+// There are no virtual functions: every concrete block passes its static
+// `manage` function to the constructor, and that single function pointer is
+// all the type erasure there is (and all the indirect calls a release makes).
+template <typename Policy>
 class control_block {
 public:
-  size_t get_strong() const;
-  void inc_strong();
-  void dec_strong();
-  void inc_weak();
-  void dec_weak();
+  size_t get_strong() const noexcept {
+    return strong_of(counts.load(std::memory_order_relaxed));
+  }
+
+  // Whether the caller's shared_ptr is the only reference of any kind, so
+  // that no other thread can reach the object. The acquire pairs with the
+  // release decrements of the previous owners: their accesses to the object
+  // are over before the caller goes on to modify it.
+  bool is_unique() const noexcept {
+    return counts.load(std::memory_order_acquire) == strong_one + weak_one;
+  }
+
+  // `n` references at once, for the helpers that move many of them around
+  void inc_strong(size_t n = 1) noexcept {
+    // a new reference can only be made from an existing one, so there is
+    // nothing to synchronize with here
+    [[maybe_unused]] uint64_t old =
+        counts.fetch_add(n * strong_one, std::memory_order_relaxed);
+    note(stats::event::strong_inc, n, strong_of(old) + n);
+  }
+
+  void dec_strong(size_t n = 1) noexcept {
+    note(stats::event::strong_dec, n);
+    // We hold the last references of any kind: nobody else can touch the
+    // counters anymore, so skip the RMWs altogether. The acquire pairs with
+    // the release decrements of the previous owners.
+    if (counts.load(std::memory_order_acquire) == n * strong_one + weak_one) {
+      dispose_and_destroy();
+      return;
+    }
+    // release: make our writes to the object visible to the thread that
+    // destroys it; acquire: the destroying thread sees everyone's writes
+    if (strong_of(counts.fetch_sub(n * strong_one,
+                                   std::memory_order_acq_rel)) == n) {
+      dispose();
+      // the weak reference held on behalf of all shared_ptrs
+      release_weak();
+    }
+  }
+
+  // A strong reference made from a weak one, unless the object is gone
+  // already: the count must not come back from zero, so only a CAS will do.
+  // Ordered like inc_strong, since the caller's weak reference already keeps
+  // the block alive.
+  bool try_inc_strong() noexcept {
+    uint64_t cur = counts.load(std::memory_order_relaxed);
+    do {
+      if (strong_of(cur) == 0) {
+        note(stats::event::lock_miss);
+        return false;
+      }
+    } while (!counts.compare_exchange_weak(cur, cur + strong_one,
+                                           std::memory_order_relaxed,
+                                           std::memory_order_relaxed));
+    note(stats::event::lock_hit, 1, strong_of(cur) + 1);
+    return true;
+  }
+
+  void inc_weak() noexcept {
+    note(stats::event::weak_inc);
+    counts.fetch_add(weak_one, std::memory_order_relaxed);
+  }
+
+  void dec_weak() noexcept {
+    note(stats::event::weak_dec);
+    release_weak();
+  }
+
+  // what the instrumentation tells block types apart by
+  const void* type_key() const noexcept {
+    return reinterpret_cast<const void*>(manage);
+  }
 
 protected:
-  virtual void delete_data() = 0;
-  virtual ~control_block() = default;
+  using manager = void (*)(control_block*, block_op) noexcept;
+
+  // the allocation is recorded by whoever made the block, once it is
+  // complete: a block whose constructor throws is never counted
+  explicit control_block(manager manage_) noexcept : manage(manage_) {}
+
+  ~control_block() = default;
+
+  void note([[maybe_unused]] stats::event e, [[maybe_unused]] size_t n = 1,
+            [[maybe_unused]] size_t use_count = 0) const noexcept {
+#ifdef SHARED_PTR_INSTRUMENT
+    stats::record(type_key(), e, n, use_count);
+#endif
+  }
 
 private:
-  // NOTE: weak_cnt   = |strong| + |weak|
-  //       strong_cnt = |strong|
-  size_t strong_cnt{0};
-  size_t weak_cnt{0};
+  void release_weak() noexcept {
+    if (weak_of(counts.fetch_sub(weak_one, std::memory_order_acq_rel)) == 1) {
+      destroy();
+    }
+  }
+
+
+  void dispose() noexcept;
+  void destroy() noexcept;
+  void dispose_and_destroy() noexcept;
+
+  static constexpr uint64_t weak_one = 1;
+  static constexpr uint64_t strong_one = uint64_t{1} << 32;
+
+  static size_t strong_of(uint64_t value) noexcept {
+    return static_cast<size_t>(value >> 32);
+  }
+
+  static size_t weak_of(uint64_t value) noexcept {
+    return static_cast<size_t>(value & (strong_one - 1));
+  }
+
+private:
+  typename Policy::template counter<uint64_t> counts{strong_one + weak_one};
+  manager manage;
+};
+
+// the release paths are defined in shared-ptr.cpp for the policies above
+extern template class control_block<atomic_counting>;
+extern template class control_block<local_counting>;
+
+// Keeps an empty (and non-final) T as a base so that it takes no space in the
+// block; Index tells apart several holders in one class
+template <typename T, size_t Index,
+          bool = std::is_empty_v<T> && !std::is_final_v<T>>
+class ebo_storage : private T {
+public:
+  template <typename U>
+  explicit ebo_storage(U&& value) : T(std::forward<U>(value)) {}
+
+  T& get() noexcept {
+    return *this;
+  }
 };
 
-template <typename T, typename D = std::default_delete<T>>
-class ptr_block : public detail::control_block, private D {
+template <typename T, size_t Index>
+class ebo_storage<T, Index, false> {
 public:
-  explicit ptr_block(T* ptr_, D&& deleter = D())
-      : D(std::move(deleter)), ptr(ptr_) {
-    inc_strong();
+  template <typename U>
+  explicit ebo_storage(U&& value) : value(std::forward<U>(value)) {}
+
+  T& get() noexcept {
+    return value;
   }
 
+private:
+  T value;
+};
+
+template <typename Block, typename Alloc>
+using block_allocator =
+    typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+// Blocks are allocated and freed through the user's allocator rebound to the
+// block type
+template <typename Block, typename Alloc, typename... Args>
+Block* new_block(const Alloc& alloc, Args&&... args) {
+  using traits = std::allocator_traits<block_allocator<Block, Alloc>>;
+  block_allocator<Block, Alloc> b_alloc(alloc);
+  auto p = traits::allocate(b_alloc, 1);
+  Block* block;
+  try {
+    block = ::new (static_cast<void*>(std::to_address(p)))
+        Block(alloc, std::forward<Args>(args)...);
+  } catch (...) {
+    traits::deallocate(b_alloc, p, 1);
+    throw;
+  }
+#ifdef SHARED_PTR_INSTRUMENT
+  stats::name_block<Block>(block->type_key());
+  stats::record(block->type_key(), stats::event::allocation, 1, 1);
+#endif
+  return block;
+}
+
+template <typename Block, typename Alloc>
+void delete_block(Block* block, const Alloc& alloc) noexcept {
+  using traits = std::allocator_traits<block_allocator<Block, Alloc>>;
+  // copy the allocator out before it dies together with the block
+  block_allocator<Block, Alloc> b_alloc(alloc);
+  block->~Block();
+  traits::deallocate(
+      b_alloc,
+      std::pointer_traits<typename traits::pointer>::pointer_to(*block), 1);
+}
+
+template <typename T, typename D, typename Alloc, typename Policy>
+class ptr_block : public detail::control_block<Policy>,
+                  private ebo_storage<D, 0>,
+                  private ebo_storage<Alloc, 1> {
+  using deleter_holder = ebo_storage<D, 0>;
+  using alloc_holder = ebo_storage<Alloc, 1>;
+
+public:
+  ptr_block(const Alloc& alloc, T* ptr_, D&& deleter)
+      : detail::control_block<Policy>(&manage),
+        deleter_holder(std::move(deleter)), alloc_holder(alloc), ptr(ptr_) {}
+
   T* get() {
     return ptr;
   }
 
-protected:
-  void delete_data() override {
-    static_cast<D&> (*this)(ptr);
+private:
+  static void manage(detail::control_block<Policy>* cb, block_op op) noexcept {
+    auto* self = static_cast<ptr_block*>(cb);
+    if (op != block_op::destroy) {
+      self->delete_data();
+    }
+    if (op != block_op::dispose) {
+      delete_block(self, self->alloc_holder::get());
+    }
+  }
+
+  void delete_data() {
+    deleter_holder::get()(ptr);
     ptr = nullptr;
   }
 
@@ -49,53 +430,438 @@ private:
   T* ptr{nullptr};
 };
 
+// Room for the deleter of an erased_ptr_block: two pointers hold function
+// pointers, empty function objects and lambdas capturing a pointer or two
+constexpr size_t erased_deleter_size = 2 * sizeof(void*);
+
+template <typename D>
+constexpr bool fits_erased_v = sizeof(D) <= erased_deleter_size &&
+                               alignof(D) <= alignof(void*);
+
+// The block for a pointer and a deleter of any type that fits the small
+// buffer: one block type (and one `manage`, in shared-ptr.cpp) per policy
+// however many deleter types there are. The typed part is a single
+// function per pointer/deleter pair, which calls and destroys the
+// deleter. Always allocated by default_block_allocator.
+template <typename Policy>
+class erased_ptr_block : public detail::control_block<Policy> {
+  using invoker = void (*)(block_op, void* deleter, void* ptr) noexcept;
+
+public:
+  template <typename Alloc, typename Y, typename D>
+  erased_ptr_block(const Alloc&, Y* ptr_, D&& deleter)
+      : detail::control_block<Policy>(&manage),
+        ptr(const_cast<std::remove_cv_t<Y>*>(ptr_)), invoke(&run<Y, D>) {
+    static_assert(fits_erased_v<D>);
+    ::new (static_cast<void*>(storage)) D(std::move(deleter));
+  }
+
+private:
+  static void manage(detail::control_block<Policy>* cb, block_op op) noexcept;
+
+  // calls the deleter unless `op` only frees the block, destroys it unless
+  // `op` only disposes of the object
+  template <typename Y, typename D>
+  static void run(block_op op, void* deleter, void* ptr) noexcept {
+    D& d = *std::launder(static_cast<D*>(deleter));
+    if (op != block_op::destroy) {
+      d(static_cast<Y*>(ptr));
+    }
+    if (op != block_op::dispose) {
+      d.~D();
+    }
+  }
+
+private:
+  void* ptr;
+  invoker invoke;
+  alignas(void*) unsigned char storage[erased_deleter_size];
+};
+
+extern template class erased_ptr_block<atomic_counting>;
+extern template class erased_ptr_block<local_counting>;
+
+// Alignment that keeps the object off the cache line of the counters
+constexpr size_t cache_line_size = 64;
+
+// selects default- rather than value-initialization of the object
+struct for_overwrite_t {
+  explicit for_overwrite_t() = default;
+};
+
 // no custom deleter since we manage the allocation/deallocation by ourselves
-template <typename T>
-class obj_block : public detail::control_block {
+// `Align` over-aligns the object, see make_shared_padded. `Overwrite` blocks
+// default-initialize the object, which the allocator then has no part in.
+template <typename T, typename Alloc, typename Policy,
+          size_t Align = alignof(T), bool Overwrite = false>
+class obj_block : public detail::control_block<Policy>,
+                  private ebo_storage<Alloc, 0> {
+  using alloc_holder = ebo_storage<Alloc, 0>;
+  // the object itself is constructed and destroyed through the allocator
+  // rebound to its type, as allocate_shared requires
+  using obj_allocator = block_allocator<std::remove_cv_t<T>, Alloc>;
+  using obj_traits = std::allocator_traits<obj_allocator>;
+
 public:
   template <typename... Args>
-  explicit obj_block(Args&&... args) {
-    new (&obj) T(std::forward<Args>(args)...);
+  explicit obj_block(const Alloc& alloc, Args&&... args)
+      : detail::control_block<Policy>(&manage), alloc_holder(alloc) {
+    obj_allocator o_alloc(alloc);
+    obj_traits::construct(o_alloc, raw(), std::forward<Args>(args)...);
+  }
+
+  // default-initializes the object, leaving trivial types uninitialized
+  obj_block(const Alloc& alloc, for_overwrite_t)
+      : detail::control_block<Policy>(&manage), alloc_holder(alloc) {
+    static_assert(Overwrite, "destroyed the way it was made");
+    ::new (static_cast<void*>(raw())) std::remove_cv_t<T>;
   }
 
   T* get() {
     return reinterpret_cast<T*>(&obj);
   }
 
-protected:
-  void delete_data() override {
-    get()->~T();
+  // whether `cb` is an obj_block of exactly this type
+  static bool is_same_type(const detail::control_block<Policy>* cb) noexcept {
+    return cb->type_key() == reinterpret_cast<const void*>(&manage);
   }
 
 private:
-  std::aligned_storage_t<sizeof(T), alignof(T)> obj;
+  static void manage(detail::control_block<Policy>* cb, block_op op) noexcept {
+    auto* self = static_cast<obj_block*>(cb);
+    if (op != block_op::destroy) {
+      self->delete_data();
+    }
+    if (op != block_op::dispose) {
+      delete_block(self, self->alloc_holder::get());
+    }
+  }
+
+  void delete_data() {
+    if constexpr (Overwrite) {
+      std::destroy_at(raw());
+    } else {
+      obj_allocator o_alloc(alloc_holder::get());
+      obj_traits::destroy(o_alloc, raw());
+    }
+  }
+
+  std::remove_cv_t<T>* raw() {
+    return reinterpret_cast<std::remove_cv_t<T>*>(&obj);
+  }
+
+private:
+  std::aligned_storage_t<sizeof(T), std::max(Align, alignof(T))> obj;
+};
+
+// Destroys and frees an object that was allocated on its own through Alloc
+// (already rebound to the object type)
+template <typename Alloc>
+class alloc_deleter : private ebo_storage<Alloc, 0> {
+  using alloc_holder = ebo_storage<Alloc, 0>;
+  using traits = std::allocator_traits<Alloc>;
+
+public:
+  explicit alloc_deleter(const Alloc& alloc) : alloc_holder(alloc) {}
+
+  template <typename T>
+  void operator()(T* p) {
+    Alloc& alloc = alloc_holder::get();
+    auto* raw = const_cast<std::remove_cv_t<T>*>(p);
+    traits::destroy(alloc, raw);
+    traits::deallocate(
+        alloc, std::pointer_traits<typename traits::pointer>::pointer_to(*raw),
+        1);
+  }
+};
+
+template <size_t Align>
+struct alignas(Align) storage_unit {
+  unsigned char bytes[Align];
+};
+
+// Where the elements of an array_block go. Only usable once the block type
+// is complete, i.e. from inside its member functions.
+template <typename Block, typename T, typename Alloc>
+struct array_layout {
+  using unit = storage_unit<std::max(alignof(Block), alignof(T))>;
+  using unit_allocator = block_allocator<unit, Alloc>;
+  using traits = std::allocator_traits<unit_allocator>;
+
+  static constexpr size_t data_offset =
+      (sizeof(Block) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+  // throws std::bad_array_new_length if the allocation would not fit a size_t
+  static size_t units(size_t size) {
+    constexpr size_t max_size =
+        (SIZE_MAX - data_offset - (sizeof(unit) - 1)) / sizeof(T);
+    if (size > max_size) {
+      throw std::bad_array_new_length();
+    }
+    return (data_offset + size * sizeof(T) + sizeof(unit) - 1) / sizeof(unit);
+  }
+};
+
+// `size` elements laid out right after the block, in the same allocation.
+// T is a scalar: arrays of arrays are flattened by the factories.
+// `Overwrite` blocks hold default-initialized elements, constructed and
+// destroyed without the allocator.
+template <typename T, typename Alloc, typename Policy, bool Overwrite = false>
+class array_block : public detail::control_block<Policy>,
+                    private ebo_storage<Alloc, 0> {
+  using alloc_holder = ebo_storage<Alloc, 0>;
+  using elem_allocator = block_allocator<std::remove_cv_t<T>, Alloc>;
+
+public:
+  // `init(elem_alloc, p, i)` constructs the i-th element at `p`
+  template <typename Init>
+  static array_block* create(const Alloc& alloc, size_t size, Init init) {
+    using layout = array_layout<array_block, T, Alloc>;
+    typename layout::unit_allocator u_alloc(alloc);
+    auto p = layout::traits::allocate(u_alloc, layout::units(size));
+    auto* self = ::new (static_cast<void*>(std::to_address(p)))
+        array_block(alloc, size);
+    elem_allocator e_alloc(alloc);
+    size_t i = 0;
+    try {
+      for (; i != size; ++i) {
+        init(e_alloc, self->raw() + i, i);
+      }
+    } catch (...) {
+      self->destroy_elements(i);
+      self->~array_block();
+      layout::traits::deallocate(u_alloc, p, layout::units(size));
+      throw;
+    }
+#ifdef SHARED_PTR_INSTRUMENT
+    stats::name_block<array_block>(self->type_key());
+    stats::record(self->type_key(), stats::event::allocation, 1, 1);
+#endif
+    return self;
+  }
+
+  T* get() noexcept {
+    return raw();
+  }
+
+private:
+  array_block(const Alloc& alloc, size_t size_) noexcept
+      : detail::control_block<Policy>(&manage), alloc_holder(alloc),
+        size(size_) {}
+
+  static void manage(detail::control_block<Policy>* cb, block_op op) noexcept {
+    auto* self = static_cast<array_block*>(cb);
+    if (op != block_op::destroy) {
+      self->destroy_elements(self->size);
+    }
+    if (op != block_op::dispose) {
+      using layout = array_layout<array_block, T, Alloc>;
+      using pointer = typename layout::traits::pointer;
+      typename layout::unit_allocator u_alloc(self->alloc_holder::get());
+      size_t n = layout::units(self->size);
+      auto& first = *reinterpret_cast<typename layout::unit*>(self);
+      self->~array_block();
+      layout::traits::deallocate(
+          u_alloc, std::pointer_traits<pointer>::pointer_to(first), n);
+    }
+  }
+
+  // in reverse order of construction
+  void destroy_elements(size_t n) noexcept {
+    if constexpr (Overwrite) {
+      while (n != 0) {
+        std::destroy_at(raw() + --n);
+      }
+    } else {
+      elem_allocator e_alloc(alloc_holder::get());
+      while (n != 0) {
+        std::allocator_traits<elem_allocator>::destroy(e_alloc, raw() + --n);
+      }
+    }
+  }
+
+  std::remove_cv_t<T>* raw() noexcept {
+    return reinterpret_cast<std::remove_cv_t<T>*>(
+        reinterpret_cast<unsigned char*>(this) +
+        array_layout<array_block, T, Alloc>::data_offset);
+  }
+
+private:
+  size_t size;
+};
+
+// element initializers for array_block::create
+struct array_value_init {
+  template <typename Alloc, typename T>
+  void operator()(Alloc& alloc, T* p, size_t) const {
+    std::allocator_traits<Alloc>::construct(alloc, p);
+  }
 };
-} // namespace detail
 
 template <typename T>
+struct array_fill_init {
+  // the pattern repeats every `size` elements
+  const T* pattern;
+  size_t size;
+
+  template <typename Alloc>
+  void operator()(Alloc& alloc, std::remove_cv_t<T>* p, size_t i) const {
+    std::allocator_traits<Alloc>::construct(alloc, p, pattern[i % size]);
+  }
+};
+
+struct array_default_init {
+  template <typename Alloc, typename T>
+  void operator()(Alloc&, T* p, size_t) const {
+    ::new (static_cast<void*>(p)) T;
+  }
+};
+} // namespace detail
+
+// Selects the erased_ptr_block for a pointer and its deleter, see
+// shared_ptr(Y*, D, erase_deleter_t)
+struct erase_deleter_t {
+  explicit erase_deleter_t() = default;
+};
+
+inline constexpr erase_deleter_t erase_deleter{};
+
+template <typename T, typename Policy = atomic_counting>
 class weak_ptr;
 
-template <typename T>
-class shared_ptr {
-  friend weak_ptr<T>;
+template <typename T, typename Policy = atomic_counting>
+class enable_shared_from_this;
+
+namespace detail {
+struct shared_ptr_access;
+
+// Whether a shared_ptr<T> may take ownership of a Y*: for arrays the element
+// types have to agree up to cv-qualification
+template <typename Y, typename T>
+struct is_ownable : std::is_convertible<Y*, T*> {};
+
+template <typename Y, typename U>
+struct is_ownable<Y, U[]> : std::is_convertible<Y (*)[], U (*)[]> {};
+
+template <typename Y, typename U, size_t N>
+struct is_ownable<Y, U[N]> : std::is_convertible<Y (*)[N], U (*)[N]> {};
+
+template <typename Y, typename T>
+constexpr bool is_ownable_v = is_ownable<Y, T>::value;
+
+// Whether a shared_ptr<T> may adopt a unique_ptr<Y, D>: it has to hold a
+// plain pointer, which the block hands to the deleter as is, and only arrays
+// go to arrays
+template <typename Y, typename D, typename T>
+constexpr bool is_adoptable_v =
+    is_ownable_v<std::remove_extent_t<Y>, T> &&
+    (std::is_array_v<Y> || !std::is_array_v<T>) &&
+    std::is_same_v<typename std::unique_ptr<Y, D>::pointer,
+                   std::remove_extent_t<Y>*>;
+
+// What shared_ptr(Y*, D) hands on to the constructor making its block
+#ifdef SHARED_PTR_ERASE_DELETERS
+template <typename Y>
+constexpr erase_deleter_t default_block_choice() noexcept {
+  return erase_deleter;
+}
+#else
+template <typename Y>
+default_block_allocator<Y> default_block_choice() noexcept {
+  return {};
+}
+#endif
+
+template <typename T, typename Y>
+using default_deleter =
+    std::conditional_t<std::is_array_v<T>, std::default_delete<Y[]>,
+                       std::default_delete<Y>>;
+
+// Whether a Y* converts to a T* without looking at the object: T is not a
+// virtual base of Y (only non-virtual bases can be cast back down)
+template <typename Y, typename T, typename = void>
+struct is_plain_upcast
+    : std::bool_constant<std::is_same_v<std::remove_cv_t<Y>,
+                                        std::remove_cv_t<T>> ||
+                         std::is_void_v<T>> {};
+
+template <typename Y, typename T>
+struct is_plain_upcast<Y, T,
+                       std::void_t<decltype(static_cast<Y*>(
+                           std::declval<std::remove_cv_t<T>*>()))>>
+    : std::true_type {};
+
+template <typename Y, typename T>
+constexpr bool is_plain_upcast_v = is_plain_upcast<Y, T>::value;
+
+// points the enable_shared_from_this and intrusive_hook bases of a freshly
+// owned object, if it has them, to its block
+template <typename Policy, typename Y>
+void hook_owner(control_block<Policy>* cb, Y* ptr) noexcept;
+} // namespace detail
 
-  template <typename U, typename... Args>
-  friend shared_ptr<U> make_shared(Args&&... args);
+template <typename T, typename Policy = atomic_counting>
+class SHARED_PTR_TRIVIAL_ABI shared_ptr {
+  friend weak_ptr<T, Policy>;
+  friend detail::shared_ptr_access;
 
   // to retrieve control_block from shared_ptr of any type
-  template <typename Y>
+  template <typename Y, typename P>
   friend class shared_ptr;
+  template <typename Y, typename P>
+  friend class weak_ptr;
+
+  using block_type = detail::control_block<Policy>;
 
 public:
-  shared_ptr() noexcept = default;
+  // T itself for objects, the element type for arrays
+  using element_type = std::remove_extent_t<T>;
+  using weak_type = weak_ptr<T, Policy>;
 
-  shared_ptr(std::nullptr_t) noexcept {}
+  constexpr shared_ptr() noexcept = default;
 
-  template <typename Y, typename D = std::default_delete<Y>,
-            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
-  explicit shared_ptr(Y* ptr_, D deleter = D()) {
+  constexpr shared_ptr(std::nullptr_t) noexcept {}
+
+  template <typename Y, typename D = detail::default_deleter<T, Y>,
+            typename = std::enable_if_t<detail::is_ownable_v<Y, T>>>
+  explicit shared_ptr(Y* ptr_, D deleter = D())
+      : shared_ptr(ptr_, std::move(deleter),
+                   detail::default_block_choice<Y>()) {}
+
+  // The deleter goes into the small buffer of a block type shared with all
+  // other deleters of the same size or smaller, to keep the number of block
+  // types (and their code) down; larger ones get a block of their own as
+  // usual. Define SHARED_PTR_ERASE_DELETERS (for every translation unit) to
+  // make this the default for shared_ptr(Y*, D).
+  template <typename Y, typename D,
+            typename = std::enable_if_t<detail::is_ownable_v<Y, T>>>
+  shared_ptr(Y* ptr_, D deleter, erase_deleter_t) {
+    using block = detail::erased_ptr_block<Policy>;
+    if constexpr (detail::fits_erased_v<D>) {
+      try {
+        cb = detail::new_block<block>(detail::default_block_allocator<block>(),
+                                      ptr_, std::move(deleter));
+      } catch (...) {
+        deleter(ptr_);
+        throw;
+      }
+      ptr = ptr_;
+      if constexpr (!std::is_array_v<T>) {
+        detail::hook_owner(cb, ptr_);
+      }
+    } else {
+      shared_ptr(ptr_, std::move(deleter), detail::default_block_allocator<Y>())
+          .swap(*this);
+    }
+  }
+
+  // the control block is allocated and freed through `alloc`
+  template <typename Y, typename D, typename Alloc,
+            typename = std::enable_if_t<detail::is_ownable_v<Y, T>>>
+  shared_ptr(Y* ptr_, D deleter, const Alloc& alloc) {
     try {
-      auto* p_block = new detail::ptr_block<Y, D>(ptr_, std::move(deleter));
+      auto* p_block = detail::new_block<detail::ptr_block<Y, D, Alloc, Policy>>(
+          alloc, ptr_, std::move(deleter));
       // get the Y* before its type gets erased
       ptr = p_block->get();
       cb = p_block;
@@ -103,49 +869,111 @@ public:
       deleter(ptr_);
       throw;
     }
+    if constexpr (!std::is_array_v<T>) {
+      detail::hook_owner(cb, ptr_);
+    }
+  }
+
+  // Takes over the object of `other` and moves its deleter into the block,
+  // in a single allocation; a reference deleter stays a reference. If that
+  // allocation fails, `other` still owns the object.
+  template <typename Y, typename D,
+            typename = std::enable_if_t<detail::is_adoptable_v<Y, D, T>>>
+  shared_ptr(std::unique_ptr<Y, D>&& other) {
+    using elem = std::remove_extent_t<Y>;
+    using alloc = detail::default_block_allocator<elem>;
+    using held = std::conditional_t<
+        std::is_reference_v<D>,
+        std::reference_wrapper<std::remove_reference_t<D>>, D>;
+    using block = detail::ptr_block<elem, held, alloc, Policy>;
+
+    if (!other) {
+      return;
+    }
+    if constexpr (std::is_reference_v<D>) {
+      cb = detail::new_block<block>(alloc(), other.get(),
+                                    std::ref(other.get_deleter()));
+    } else {
+      cb = detail::new_block<block>(alloc(), other.get(),
+                                    std::move(other.get_deleter()));
+    }
+    elem* owned = other.release();
+    ptr = owned;
+    if constexpr (!std::is_array_v<T>) {
+      detail::hook_owner(cb, owned);
+    }
   }
 
   shared_ptr(const shared_ptr& other) noexcept : cb(other.cb), ptr(other.ptr) {
     safe_inc();
   }
 
-  shared_ptr(shared_ptr&& other) noexcept : shared_ptr{} {
-    swap(other);
+  shared_ptr(shared_ptr&& other) noexcept : cb(other.cb), ptr(other.ptr) {
+    other.nullify();
   }
 
   template <typename Y>
-  shared_ptr(const shared_ptr<Y>& p, T* ptr_) : cb(p.cb), ptr(ptr_) {
+  shared_ptr(const shared_ptr<Y, Policy>& p, element_type* ptr_) noexcept
+      : cb(p.cb), ptr(ptr_) {
     safe_inc();
   }
 
+  // takes over the reference of `p`, leaving it empty
   template <typename Y>
-  shared_ptr(const shared_ptr<Y>& p) : shared_ptr(p, p.get()) {}
+  shared_ptr(shared_ptr<Y, Policy>&& p, element_type* ptr_) noexcept
+      : cb(p.cb), ptr(ptr_) {
+    p.nullify();
+  }
+
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  shared_ptr(const shared_ptr<Y, Policy>& p) noexcept
+      : shared_ptr(p, p.get()) {}
+
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  shared_ptr(shared_ptr<Y, Policy>&& p) noexcept : cb(p.cb), ptr(p.get()) {
+    p.nullify();
+  }
 
   shared_ptr& operator=(const shared_ptr& other) noexcept {
-    shared_ptr<T> tmp(other);
+    shared_ptr tmp(other);
     swap(tmp);
     return *this;
   }
 
   shared_ptr& operator=(shared_ptr&& other) noexcept {
-    // NOTE: I decided to do a swap trick since it handles self-assignment
-    // properly and is easier to read than `if (this == &other) ...`
-    shared_ptr<T> tmp(std::move(other));
-    swap(tmp);
+    if (this != &other) {
+      take(other);
+    }
+    return *this;
+  }
+
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  shared_ptr& operator=(shared_ptr<Y, Policy>&& other) noexcept {
+    take(other);
+    return *this;
+  }
+
+  template <typename Y, typename D,
+            typename = std::enable_if_t<detail::is_adoptable_v<Y, D, T>>>
+  shared_ptr& operator=(std::unique_ptr<Y, D>&& other) {
+    shared_ptr(std::move(other)).swap(*this);
     return *this;
   }
 
-  friend bool operator==(const shared_ptr<T>& lhs,
-                         const shared_ptr<T>& rhs) noexcept {
+  friend bool operator==(const shared_ptr& lhs,
+                         const shared_ptr& rhs) noexcept {
     return lhs.ptr == rhs.ptr;
   }
 
-  friend bool operator!=(const shared_ptr<T>& lhs,
-                         const shared_ptr<T>& rhs) noexcept {
+  friend bool operator!=(const shared_ptr& lhs,
+                         const shared_ptr& rhs) noexcept {
     return lhs.ptr != rhs.ptr;
   }
 
-  T* get() const noexcept {
+  element_type* get() const noexcept {
     return ptr;
   }
 
@@ -153,18 +981,50 @@ public:
     return get();
   }
 
-  T& operator*() const noexcept {
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U& operator*() const noexcept {
     return *get();
   }
 
-  T* operator->() const noexcept {
+  template <typename U = T, typename = std::enable_if_t<!std::is_array_v<U>>>
+  U* operator->() const noexcept {
     return get();
   }
 
+  template <typename U = T, typename = std::enable_if_t<std::is_array_v<U>>>
+  std::remove_extent_t<U>& operator[](std::ptrdiff_t i) const noexcept {
+    return get()[i];
+  }
+
   std::size_t use_count() const noexcept {
     return cb ? cb->get_strong() : 0;
   }
 
+  // by control block, see owner_less
+  template <typename Y>
+  bool owner_before(const shared_ptr<Y, Policy>& other) const noexcept {
+    return std::less<const void*>()(cb, other.cb);
+  }
+
+  template <typename Y>
+  bool owner_before(const weak_ptr<Y, Policy>& other) const noexcept {
+    return std::less<const void*>()(cb, other.cb);
+  }
+
+  template <typename Y>
+  bool owner_equal(const shared_ptr<Y, Policy>& other) const noexcept {
+    return cb == other.cb;
+  }
+
+  template <typename Y>
+  bool owner_equal(const weak_ptr<Y, Policy>& other) const noexcept {
+    return cb == other.cb;
+  }
+
+  size_t owner_hash() const noexcept {
+    return std::hash<const void*>()(cb);
+  }
+
   void reset() noexcept {
     if (cb) {
       cb->dec_strong();
@@ -172,82 +1032,172 @@ public:
     nullify();
   }
 
-  template <typename Y, typename D = std::default_delete<Y>,
-            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  template <typename Y, typename D = detail::default_deleter<T, Y>,
+            typename = std::enable_if_t<detail::is_ownable_v<Y, T>>>
   void reset(Y* new_ptr, D deleter = D()) {
-    *this = shared_ptr<Y>(new_ptr, std::move(deleter));
+    *this = shared_ptr(new_ptr, std::move(deleter));
+  }
+
+  template <typename Y, typename D, typename Alloc,
+            typename = std::enable_if_t<detail::is_ownable_v<Y, T>>>
+  void reset(Y* new_ptr, D deleter, const Alloc& alloc) {
+    *this = shared_ptr(new_ptr, std::move(deleter), alloc);
   }
 
   ~shared_ptr() {
     reset();
   }
 
-  void swap(shared_ptr<T>& other) {
+  void swap(shared_ptr& other) noexcept {
     using std::swap;
     swap(cb, other.cb);
     swap(ptr, other.ptr);
   }
 
+  friend void swap(shared_ptr& lhs, shared_ptr& rhs) noexcept {
+    lhs.swap(rhs);
+  }
+
 private:
-  shared_ptr(detail::control_block* cb_, T* ptr_) : cb(cb_), ptr(ptr_) {
-    safe_inc();
+  // adopts the strong reference the caller holds on `cb_`
+  shared_ptr(block_type* cb_, element_type* ptr_) noexcept
+      : cb(cb_), ptr(ptr_) {}
+
+  // Moves the reference of `other` in, and only then lets go of the old one:
+  // its destructor may well reach this pointer again
+  template <typename Y>
+  void take(shared_ptr<Y, Policy>& other) noexcept {
+    block_type* old = cb;
+    cb = other.cb;
+    ptr = other.get();
+    other.nullify();
+    if (old) {
+      old->dec_strong();
+    }
   }
 
-  void nullify() {
+  void nullify() noexcept {
     ptr = nullptr;
     cb = nullptr;
   }
 
-  void safe_inc() {
+  void safe_inc() noexcept {
     if (cb) {
       cb->inc_strong();
     }
   }
 
 private:
-  detail::control_block* cb{nullptr};
-  T* ptr{nullptr};
+  block_type* cb{nullptr};
+  element_type* ptr{nullptr};
 };
 
-template <typename T>
-class weak_ptr {
+template <typename T, typename Policy>
+class SHARED_PTR_TRIVIAL_ABI weak_ptr {
+  friend detail::shared_ptr_access;
+
+  template <typename Y, typename P>
+  friend class shared_ptr;
+
+  using block_type = detail::control_block<Policy>;
+
 public:
-  weak_ptr() noexcept = default;
+  using element_type = std::remove_extent_t<T>;
+
+  constexpr weak_ptr() noexcept = default;
+
+  weak_ptr(const shared_ptr<T, Policy>& other) noexcept
+      : cb(other.cb), ptr(other.ptr) {
+    safe_inc();
+  }
+
+  weak_ptr(const weak_ptr& other) noexcept : cb(other.cb), ptr(other.ptr) {
+    safe_inc();
+  }
 
-  weak_ptr(const shared_ptr<T>& other) noexcept : cb(other.cb), ptr(other.ptr) {
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  weak_ptr(const shared_ptr<Y, Policy>& other) noexcept
+      : cb(other.cb), ptr(other.ptr) {
     safe_inc();
   }
 
-  weak_ptr(const weak_ptr<T>& other) noexcept : cb(other.cb), ptr(other.ptr) {
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  weak_ptr(const weak_ptr<Y, Policy>& other) noexcept
+      : cb(other.cb), ptr(upcast(other)) {
     safe_inc();
   }
 
-  weak_ptr(weak_ptr<T>&& other) noexcept : weak_ptr{} {
-    swap(other);
+  template <typename Y,
+            typename = std::enable_if_t<std::is_convertible_v<Y*, T*>>>
+  weak_ptr(weak_ptr<Y, Policy>&& other) noexcept
+      : cb(other.cb), ptr(upcast(other)) {
+    other.cb = nullptr;
+    other.ptr = nullptr;
+  }
+
+  weak_ptr(weak_ptr&& other) noexcept : cb(other.cb), ptr(other.ptr) {
+    other.cb = nullptr;
+    other.ptr = nullptr;
   }
 
-  weak_ptr& operator=(weak_ptr<T>&& other) noexcept {
-    weak_ptr<T> tmp(std::move(other));
+  weak_ptr& operator=(weak_ptr&& other) noexcept {
+    weak_ptr tmp(std::move(other));
     swap(tmp);
     return *this;
   }
 
-  weak_ptr& operator=(const weak_ptr<T>& other) noexcept {
-    weak_ptr<T> tmp(other);
+  weak_ptr& operator=(const weak_ptr& other) noexcept {
+    weak_ptr tmp(other);
     swap(tmp);
     return *this;
   }
 
-  weak_ptr& operator=(const shared_ptr<T>& other) noexcept {
-    weak_ptr<T> tmp(other);
+  weak_ptr& operator=(const shared_ptr<T, Policy>& other) noexcept {
+    weak_ptr tmp(other);
     swap(tmp);
     return *this;
   }
 
-  shared_ptr<T> lock() const noexcept {
-    if (cb && cb->get_strong() != 0)
-      return shared_ptr<T>(cb, ptr);
-    return shared_ptr<T>();
+  std::size_t use_count() const noexcept {
+    return cb ? cb->get_strong() : 0;
+  }
+
+  bool expired() const noexcept {
+    return use_count() == 0;
+  }
+
+  // by control block, see owner_less
+  template <typename Y>
+  bool owner_before(const shared_ptr<Y, Policy>& other) const noexcept {
+    return std::less<const void*>()(cb, other.cb);
+  }
+
+  template <typename Y>
+  bool owner_before(const weak_ptr<Y, Policy>& other) const noexcept {
+    return std::less<const void*>()(cb, other.cb);
+  }
+
+  template <typename Y>
+  bool owner_equal(const shared_ptr<Y, Policy>& other) const noexcept {
+    return cb == other.cb;
+  }
+
+  template <typename Y>
+  bool owner_equal(const weak_ptr<Y, Policy>& other) const noexcept {
+    return cb == other.cb;
+  }
+
+  size_t owner_hash() const noexcept {
+    return std::hash<const void*>()(cb);
+  }
+
+  shared_ptr<T, Policy> lock() const noexcept {
+    if (cb && cb->try_inc_strong()) {
+      return shared_ptr<T, Policy>(cb, ptr);
+    }
+    return shared_ptr<T, Policy>();
   }
 
   ~weak_ptr() {
@@ -257,26 +1207,537 @@ public:
     ptr = nullptr;
   }
 
-  void swap(weak_ptr<T>& other) {
+  void swap(weak_ptr& other) noexcept {
     using std::swap;
     swap(cb, other.cb);
     swap(ptr, other.ptr);
   }
 
+  friend void swap(weak_ptr& lhs, weak_ptr& rhs) noexcept {
+    lhs.swap(rhs);
+  }
+
 private:
-  void safe_inc() {
+  template <typename Y, typename P>
+  friend class weak_ptr;
+
+  weak_ptr(block_type* cb_, element_type* ptr_) noexcept : cb(cb_), ptr(ptr_) {
+    safe_inc();
+  }
+
+  // Converting the pointer of a possibly expired weak_ptr<Y>: going to a
+  // virtual base reads the object's vtable, which may be gone already, so
+  // that takes a lock. Every other conversion is plain pointer arithmetic.
+  template <typename Y>
+  static element_type* upcast(const weak_ptr<Y, Policy>& other) noexcept {
+    if constexpr (detail::is_plain_upcast_v<Y, element_type>) {
+      return other.ptr;
+    } else {
+      return other.lock().get();
+    }
+  }
+
+  void safe_inc() noexcept {
     if (cb) {
       cb->inc_weak();
     }
   }
 
 private:
-  detail::control_block* cb{nullptr};
-  T* ptr{nullptr};
+  block_type* cb{nullptr};
+  element_type* ptr{nullptr};
+};
+
+// Whether an object can be moved to new memory by copying its bytes, with
+// the old copy then forgotten rather than destroyed. The pointer types can:
+// a move leaves nothing behind that their destructors would have to undo.
+// Specialize it for other types that can.
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<shared_ptr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<weak_ptr<T, Policy>> : std::true_type {};
+
+template <typename T>
+constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+// Moves [first, last) to the uninitialized memory at `out` and ends the
+// lifetime of the originals, like a vector does when it grows. A single
+// memcpy for trivially relocatable types.
+template <typename T>
+T* uninitialized_relocate(T* first, T* last, T* out) noexcept(
+    is_trivially_relocatable_v<T> || std::is_nothrow_move_constructible_v<T>) {
+  if constexpr (is_trivially_relocatable_v<T>) {
+    if (first != last) {
+      std::memcpy(static_cast<void*>(out), static_cast<const void*>(first),
+                  (last - first) * sizeof(T));
+    }
+    return out + (last - first);
+  } else {
+    out = std::uninitialized_move(first, last, out);
+    std::destroy(first, last);
+    return out;
+  }
+}
+
+// Base for objects handled through intrusive_ptr (see intrusive-ptr.h): it
+// keeps a pointer to the object's control block, filled in by make_shared &
+// co. and by the owning shared_ptr constructors, so that a bare T* is enough
+// to reach the reference counts.
+template <typename Policy = atomic_counting>
+class intrusive_hook {
+  friend detail::shared_ptr_access;
+
+protected:
+  constexpr intrusive_hook() noexcept = default;
+
+  // a copy is a different object with owners of its own
+  intrusive_hook(const intrusive_hook&) noexcept {}
+
+  intrusive_hook& operator=(const intrusive_hook&) noexcept {
+    return *this;
+  }
+
+  ~intrusive_hook() = default;
+
+private:
+  mutable detail::control_block<Policy>* block{nullptr};
 };
 
+// Lets an object owned by shared_ptrs hand out more of them. The base is
+// hooked up by make_shared & co. and by the owning shared_ptr constructors at
+// no extra cost: shared_from_this() is a reference count bump on the block
+// the object already has.
+template <typename T, typename Policy>
+class enable_shared_from_this {
+  friend detail::shared_ptr_access;
+
+public:
+  shared_ptr<T, Policy> shared_from_this() {
+    return watch(weak_this.lock());
+  }
+
+  shared_ptr<const T, Policy> shared_from_this() const {
+    return watch(shared_ptr<const T, Policy>(weak_this.lock()));
+  }
+
+  weak_ptr<T, Policy> weak_from_this() noexcept {
+    return weak_this;
+  }
+
+  weak_ptr<const T, Policy> weak_from_this() const noexcept {
+    return weak_this;
+  }
+
+protected:
+  constexpr enable_shared_from_this() noexcept = default;
+
+  // a copy is a different object with owners of its own
+  enable_shared_from_this(const enable_shared_from_this&) noexcept {}
+
+  enable_shared_from_this& operator=(const enable_shared_from_this&) noexcept {
+    return *this;
+  }
+
+  ~enable_shared_from_this() = default;
+
+private:
+  template <typename Y>
+  static shared_ptr<Y, Policy> watch(shared_ptr<Y, Policy>&& p) {
+    if (!p) {
+      throw std::bad_weak_ptr();
+    }
+    return std::move(p);
+  }
+
+private:
+  mutable weak_ptr<T, Policy> weak_this;
+};
+
+namespace detail {
+// Lets the factories and helpers below reach into shared_ptr without
+// befriending each of them
+struct shared_ptr_access {
+  // wraps the strong reference the caller holds on `cb`
+  template <typename T, typename Policy>
+  static shared_ptr<T, Policy> adopt(control_block<Policy>* cb,
+                                     std::remove_extent_t<T>* ptr) noexcept {
+    return shared_ptr<T, Policy>(cb, ptr);
+  }
+
+  template <typename T, typename Policy>
+  static control_block<Policy>* block(const shared_ptr<T, Policy>& p) noexcept {
+    return p.cb;
+  }
+
+  // the caller takes over the reference `p` held
+  template <typename T, typename Policy>
+  static void release(shared_ptr<T, Policy>& p) noexcept {
+    p.nullify();
+  }
+
+  template <typename Policy, typename U, typename Y>
+  static void enable_from_this(control_block<Policy>* cb,
+                               const enable_shared_from_this<U, Policy>* base,
+                               Y* ptr) noexcept {
+    weak_ptr<U, Policy>& weak_this = base->weak_this;
+    // the object may already be owned by another group of shared_ptrs
+    if (!weak_this.cb || weak_this.cb->get_strong() == 0) {
+      weak_this = weak_ptr<U, Policy>(
+          cb, const_cast<U*>(static_cast<const U*>(ptr)));
+    }
+  }
+
+  template <typename Policy>
+  static void enable_from_this(control_block<Policy>*, const volatile void*,
+                               const volatile void*) noexcept {}
+
+  template <typename Policy>
+  static void hook_intrusive(control_block<Policy>* cb,
+                             const intrusive_hook<Policy>* hook) noexcept {
+    if (!hook->block) {
+      hook->block = cb;
+    }
+  }
+
+  template <typename Policy>
+  static void hook_intrusive(control_block<Policy>*,
+                             const volatile void*) noexcept {}
+
+  template <typename Policy>
+  static control_block<Policy>*
+  block(const intrusive_hook<Policy>* hook) noexcept {
+    return hook->block;
+  }
+
+  template <typename T, typename Policy>
+  static weak_ptr<T, Policy>
+  make_weak(control_block<Policy>* cb, std::remove_extent_t<T>* ptr) noexcept {
+    return weak_ptr<T, Policy>(cb, ptr);
+  }
+};
+
+template <typename Policy, typename Y>
+void hook_owner(control_block<Policy>* cb, Y* ptr) noexcept {
+  if (ptr) {
+    shared_ptr_access::enable_from_this(cb, ptr, ptr);
+    shared_ptr_access::hook_intrusive(cb, ptr);
+  }
+}
+} // namespace detail
+
+// Casts sharing ownership with `r`. The rvalue versions take its reference
+// over instead of making a new one (dynamic_pointer_cast only on success).
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy>
+static_pointer_cast(const shared_ptr<U, Policy>& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  return shared_ptr<T, Policy>(r, static_cast<element*>(r.get()));
+}
+
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy> static_pointer_cast(shared_ptr<U, Policy>&& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  auto* p = static_cast<element*>(r.get());
+  return shared_ptr<T, Policy>(std::move(r), p);
+}
+
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy>
+dynamic_pointer_cast(const shared_ptr<U, Policy>& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  if (auto* p = dynamic_cast<element*>(r.get())) {
+    return shared_ptr<T, Policy>(r, p);
+  }
+  return shared_ptr<T, Policy>();
+}
+
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy> dynamic_pointer_cast(shared_ptr<U, Policy>&& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  if (auto* p = dynamic_cast<element*>(r.get())) {
+    return shared_ptr<T, Policy>(std::move(r), p);
+  }
+  return shared_ptr<T, Policy>();
+}
+
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy>
+const_pointer_cast(const shared_ptr<U, Policy>& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  return shared_ptr<T, Policy>(r, const_cast<element*>(r.get()));
+}
+
+template <typename T, typename U, typename Policy>
+shared_ptr<T, Policy> const_pointer_cast(shared_ptr<U, Policy>&& r) noexcept {
+  using element = typename shared_ptr<T, Policy>::element_type;
+  auto* p = const_cast<element*>(r.get());
+  return shared_ptr<T, Policy>(std::move(r), p);
+}
+
+// Function objects for the owner_ members, for maps and sets keyed by any mix
+// of shared_ptrs and weak_ptrs. Those order, compare and hash by control block
+// rather than by stored pointer: no count is touched, and expired weak_ptrs
+// keep their place.
+struct owner_less {
+  using is_transparent = void;
+
+  template <typename A, typename B>
+  bool operator()(const A& lhs, const B& rhs) const noexcept {
+    return lhs.owner_before(rhs);
+  }
+};
+
+struct owner_equal {
+  using is_transparent = void;
+
+  template <typename A, typename B>
+  bool operator()(const A& lhs, const B& rhs) const noexcept {
+    return lhs.owner_equal(rhs);
+  }
+};
+
+struct owner_hash {
+  using is_transparent = void;
+
+  template <typename A>
+  size_t operator()(const A& p) const noexcept {
+    return p.owner_hash();
+  }
+};
+
+// Hashing a shared_ptr goes by its stored pointer, as its == does; weak_ptr
+// has no == and is hashed by owner, as owner_equal compares
+namespace std {
+template <typename T, typename Policy>
+struct hash<::shared_ptr<T, Policy>> {
+  size_t operator()(const ::shared_ptr<T, Policy>& p) const noexcept {
+    using element = typename ::shared_ptr<T, Policy>::element_type;
+    return std::hash<element*>()(p.get());
+  }
+};
+
+template <typename T, typename Policy>
+struct hash<::weak_ptr<T, Policy>> {
+  size_t operator()(const ::weak_ptr<T, Policy>& p) const noexcept {
+    return p.owner_hash();
+  }
+};
+} // namespace std
+
+// Same implementation with plain (non-atomic) counting for pointers that
+// never leave their thread
+template <typename T>
+using local_shared_ptr = shared_ptr<T, local_counting>;
+
+template <typename T>
+using local_weak_ptr = weak_ptr<T, local_counting>;
+
+// the object and its control block are a single allocation from `alloc`
+template <typename T, typename Policy = atomic_counting, typename Alloc,
+          typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(const Alloc& alloc, Args&&... args) {
+  auto* o_block = detail::new_block<detail::obj_block<T, Alloc, Policy>>(
+      alloc, std::forward<Args>(args)...);
+  detail::hook_owner(o_block, o_block->get());
+  return detail::shared_ptr_access::adopt<T>(o_block, o_block->get());
+}
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+make_shared(Args&&... args) {
+  return allocate_shared<T, Policy>(detail::default_block_allocator<T>(),
+                                    std::forward<Args>(args)...);
+}
+
+// Like make_shared with no arguments, but default-initializes the object:
+// for trivial types the storage is left as it comes, to be written later.
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared_for_overwrite(const Alloc& alloc) {
+  auto* o_block = detail::new_block<
+      detail::obj_block<T, Alloc, Policy, alignof(T), true>>(
+      alloc, detail::for_overwrite_t());
+  detail::hook_owner(o_block, o_block->get());
+  return detail::shared_ptr_access::adopt<T>(o_block, o_block->get());
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<!std::is_array_v<T>, shared_ptr<T, Policy>>
+make_shared_for_overwrite() {
+  return allocate_shared_for_overwrite<T, Policy>(
+      detail::default_block_allocator<T>());
+}
+
+namespace detail {
+// `n` elements of T = U[] or U[N], each of them an array itself possibly;
+// the block sees them all as one flat array of scalars
+template <typename T, typename Policy, typename Alloc, typename Init>
+shared_ptr<T, Policy> allocate_array(const Alloc& alloc, size_t n, Init init) {
+  using element = std::remove_extent_t<T>;
+  using scalar = std::remove_all_extents_t<T>;
+  constexpr size_t scalars = sizeof(element) / sizeof(scalar);
+  if (n > SIZE_MAX / scalars) {
+    throw std::bad_array_new_length();
+  }
+  constexpr bool overwrite = std::is_same_v<Init, array_default_init>;
+  auto* a_block = array_block<scalar, Alloc, Policy, overwrite>::create(
+      alloc, n * scalars, init);
+  return shared_ptr_access::adopt<T>(
+      a_block, reinterpret_cast<element*>(a_block->get()));
+}
+
+template <typename T>
+array_fill_init<std::remove_all_extents_t<T>>
+array_fill(const std::remove_extent_t<T>& init) {
+  using scalar = std::remove_all_extents_t<T>;
+  return {reinterpret_cast<const scalar*>(std::addressof(init)),
+          sizeof(init) / sizeof(scalar)};
+}
+} // namespace detail
+
+// Arrays: the elements are stored inline after the counters, in a single
+// allocation. The elements are value-initialized, copies of `init`, or (the
+// _for_overwrite versions) default-initialized.
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(const Alloc& alloc, size_t n) {
+  return detail::allocate_array<T, Policy>(alloc, n,
+                                           detail::array_value_init());
+}
+
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(const Alloc& alloc, size_t n,
+                const std::remove_extent_t<T>& init) {
+  return detail::allocate_array<T, Policy>(alloc, n,
+                                           detail::array_fill<T>(init));
+}
+
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(const Alloc& alloc) {
+  return detail::allocate_array<T, Policy>(alloc, std::extent_v<T>,
+                                           detail::array_value_init());
+}
+
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared(const Alloc& alloc, const std::remove_extent_t<T>& init) {
+  return detail::allocate_array<T, Policy>(alloc, std::extent_v<T>,
+                                           detail::array_fill<T>(init));
+}
+
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared_for_overwrite(const Alloc& alloc, size_t n) {
+  return detail::allocate_array<T, Policy>(alloc, n,
+                                           detail::array_default_init());
+}
+
+template <typename T, typename Policy = atomic_counting, typename Alloc>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+allocate_shared_for_overwrite(const Alloc& alloc) {
+  return detail::allocate_array<T, Policy>(alloc, std::extent_v<T>,
+                                           detail::array_default_init());
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared(size_t n) {
+  return allocate_shared<T, Policy>(detail::default_block_allocator<T>(), n);
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared(size_t n, const std::remove_extent_t<T>& init) {
+  return allocate_shared<T, Policy>(detail::default_block_allocator<T>(), n,
+                                    init);
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared() {
+  return allocate_shared<T, Policy>(detail::default_block_allocator<T>());
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared(const std::remove_extent_t<T>& init) {
+  return allocate_shared<T, Policy>(detail::default_block_allocator<T>(),
+                                    init);
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_unbounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared_for_overwrite(size_t n) {
+  return allocate_shared_for_overwrite<T, Policy>(
+      detail::default_block_allocator<T>(), n);
+}
+
+template <typename T, typename Policy = atomic_counting>
+std::enable_if_t<std::is_bounded_array_v<T>, shared_ptr<T, Policy>>
+make_shared_for_overwrite() {
+  return allocate_shared_for_overwrite<T, Policy>(
+      detail::default_block_allocator<T>());
+}
+
 template <typename T, typename... Args>
-shared_ptr<T> make_shared(Args&&... args) {
-  auto* o_block = new detail::obj_block<T>(std::forward<Args>(args)...);
-  return shared_ptr<T>(o_block, o_block->get());
+local_shared_ptr<T> make_local_shared(Args&&... args) {
+  return make_shared<T, local_counting>(std::forward<Args>(args)...);
+}
+
+// The object starts on a cache line of its own, so that reference count
+// updates from other threads do not invalidate the lines readers of the
+// object use. Costs up to a cache line of padding per object; `alloc` has to
+// support over-aligned allocations.
+template <typename T, typename Policy = atomic_counting, typename Alloc,
+          typename... Args>
+shared_ptr<T, Policy> allocate_shared_padded(const Alloc& alloc,
+                                             Args&&... args) {
+  auto* o_block = detail::new_block<
+      detail::obj_block<T, Alloc, Policy, detail::cache_line_size>>(
+      alloc, std::forward<Args>(args)...);
+  detail::hook_owner(o_block, o_block->get());
+  return detail::shared_ptr_access::adopt<T>(o_block, o_block->get());
+}
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+shared_ptr<T, Policy> make_shared_padded(Args&&... args) {
+  return allocate_shared_padded<T, Policy>(
+      std::allocator<detail::allocated_type<T>>(), std::forward<Args>(args)...);
+}
+
+// Unlike allocate_shared the object gets an allocation of its own, which is
+// freed as soon as the last shared_ptr goes away. Meant for large objects
+// watched by long-lived weak_ptrs: those then pin only the control block.
+template <typename T, typename Policy = atomic_counting, typename Alloc,
+          typename... Args>
+shared_ptr<T, Policy> allocate_shared_separate(const Alloc& alloc,
+                                               Args&&... args) {
+  using obj_allocator = detail::block_allocator<std::remove_cv_t<T>, Alloc>;
+  using traits = std::allocator_traits<obj_allocator>;
+  obj_allocator o_alloc(alloc);
+  auto p = traits::allocate(o_alloc, 1);
+  try {
+    traits::construct(o_alloc, std::to_address(p),
+                      std::forward<Args>(args)...);
+  } catch (...) {
+    traits::deallocate(o_alloc, p, 1);
+    throw;
+  }
+  // on failure the constructor destroys and frees the object itself
+  return shared_ptr<T, Policy>(static_cast<T*>(std::to_address(p)),
+                               detail::alloc_deleter<obj_allocator>(o_alloc),
+                               alloc);
+}
+
+template <typename T, typename Policy = atomic_counting, typename... Args>
+shared_ptr<T, Policy> make_shared_separate(Args&&... args) {
+  return allocate_shared_separate<T, Policy>(
+      detail::default_block_allocator<T>(), std::forward<Args>(args)...);
 }
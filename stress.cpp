@@ -0,0 +1,296 @@
+// Stress and scalability harness for the concurrent paths: every workload
+// runs for a fixed time at 1, 2, 4, ... threads, reports the throughput and
+// the latency percentiles of a sample of its operations, and checks the
+// counts it leaves behind, so that lost updates fail the run. Build it with
+// -DUSE_TSAN=ON to have ThreadSanitizer watch the same runs.
+//
+// usage: stress [--threads N] [--millis M] [--filter substring]
+
+#include "atomic-shared-ptr.h"
+#include "shared-ptr.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+// every `sample_every`th operation of a thread is timed on its own
+constexpr size_t sample_every = 64;
+
+struct tracked {
+  explicit tracked(size_t value_) : value(value_), check(~value_) {
+    alive.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  ~tracked() {
+    check = 0;
+    alive.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool intact() const {
+    return check == ~value;
+  }
+
+  size_t value;
+  size_t check;
+
+  static std::atomic<long> alive;
+};
+
+std::atomic<long> tracked::alive{0};
+
+struct thread_result {
+  size_t ops{0};
+  std::vector<double> samples_ns;
+};
+
+// What one thread of a workload does: `op(thread_index)` is called until
+// time is up and returns false if it saw something broken
+struct workload {
+  const char* name;
+  // fresh shared state for a run with `threads` threads
+  std::function<void(size_t threads)> setup;
+  std::function<bool(size_t thread)> op;
+  // final checks, once all threads are done
+  std::function<bool()> teardown;
+};
+
+struct run_report {
+  double mops_per_s;
+  double p50_ns;
+  double p99_ns;
+  bool ok;
+};
+
+double percentile(std::vector<double>& v, double p) {
+  if (v.empty()) {
+    return 0;
+  }
+  size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+run_report run(const workload& w, size_t threads,
+               std::chrono::milliseconds duration) {
+  w.setup(threads);
+  std::vector<thread_result> results(threads);
+  std::atomic<bool> go{false};
+  std::atomic<bool> stop{false};
+  std::atomic<bool> broken{false};
+  std::vector<std::thread> pool;
+  for (size_t t = 0; t != threads; ++t) {
+    pool.emplace_back([&, t] {
+      thread_result& r = results[t];
+      while (!go.load(std::memory_order_acquire)) {
+      }
+      while (!stop.load(std::memory_order_relaxed)) {
+        bool ok;
+        if (r.ops % sample_every == 0) {
+          auto start = clock_type::now();
+          ok = w.op(t);
+          std::chrono::duration<double, std::nano> took =
+              clock_type::now() - start;
+          r.samples_ns.push_back(took.count());
+        } else {
+          ok = w.op(t);
+        }
+        if (!ok) {
+          broken.store(true);
+        }
+        ++r.ops;
+      }
+    });
+  }
+  auto start = clock_type::now();
+  go.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(duration);
+  stop.store(true);
+  for (auto& t : pool) {
+    t.join();
+  }
+  std::chrono::duration<double> took = clock_type::now() - start;
+
+  size_t ops = 0;
+  std::vector<double> samples;
+  for (auto& r : results) {
+    ops += r.ops;
+    samples.insert(samples.end(), r.samples_ns.begin(), r.samples_ns.end());
+  }
+  bool ok = w.teardown() && !broken.load();
+  return {ops / took.count() / 1e6, percentile(samples, 0.5),
+          percentile(samples, 0.99), ok};
+}
+
+// --- workloads ---
+
+// all threads copy and drop the same pointer
+shared_ptr<tracked> storm_source;
+
+workload copy_storm() {
+  return {"copy_storm",
+          [](size_t) { storm_source = make_shared<tracked>(42); },
+          [](size_t) {
+            shared_ptr<tracked> copy = storm_source;
+            return copy->intact();
+          },
+          [] {
+            bool ok = storm_source.use_count() == 1;
+            storm_source.reset();
+            return ok && tracked::alive.load() == 0;
+          }};
+}
+
+// thread 0 keeps replacing the object, the others lock weak_ptrs to it that
+// may have expired by then
+atomic_shared_ptr<tracked> lock_owner;
+std::atomic<long> lock_hits{0};
+
+workload lock_expire() {
+  return {"lock_expire",
+          [](size_t) {
+            lock_owner.store(make_shared<tracked>(0));
+            lock_hits.store(0);
+          },
+          [](size_t t) {
+            if (t == 0) {
+              lock_owner.store(make_shared<tracked>(1));
+              return true;
+            }
+            weak_ptr<tracked> w = lock_owner.load();
+            std::this_thread::yield();
+            if (shared_ptr<tracked> p = w.lock()) {
+              lock_hits.fetch_add(1, std::memory_order_relaxed);
+              return p->intact();
+            }
+            return true;
+          },
+          [] {
+            lock_owner.store(nullptr);
+            return tracked::alive.load() == 0;
+          }};
+}
+
+// every thread makes and frees objects of its own
+workload make_free_churn() {
+  return {"make_free_churn", [](size_t) {},
+          [](size_t t) {
+            shared_ptr<tracked> p = make_shared<tracked>(t);
+            weak_ptr<tracked> w = p;
+            p.reset();
+            return !w.lock();
+          },
+          [] { return tracked::alive.load() == 0; }};
+}
+
+// objects made on one thread and freed on another, through a shared slot
+// per pair of threads
+std::vector<atomic_shared_ptr<tracked>> handoff_slots(64);
+
+workload cross_thread_free() {
+  return {"cross_thread_free",
+          [](size_t) {
+            for (auto& s : handoff_slots) {
+              s.store(nullptr);
+            }
+          },
+          [](size_t t) {
+            auto& slot = handoff_slots[(t / 2) % handoff_slots.size()];
+            if (t % 2 == 0) {
+              slot.store(make_shared<tracked>(t));
+              return true;
+            }
+            shared_ptr<tracked> p = slot.exchange(nullptr);
+            return !p || p->intact();
+          },
+          [] {
+            for (auto& s : handoff_slots) {
+              s.store(nullptr);
+            }
+            return tracked::alive.load() == 0;
+          }};
+}
+
+// readers of a published pointer, thread 0 replaces it
+atomic_shared_ptr<tracked> published;
+
+workload publish_read(bool borrow) {
+  return {borrow ? "publish_borrow" : "publish_load",
+          [](size_t) { published.store(make_shared<tracked>(0)); },
+          [borrow](size_t t) {
+            if (t == 0) {
+              published.store(make_shared<tracked>(t));
+              return true;
+            }
+            if (borrow) {
+              return published.borrow()->intact();
+            }
+            return published.load()->intact();
+          },
+          [] {
+            published.store(nullptr);
+            return tracked::alive.load() == 0;
+          }};
+}
+
+void usage() {
+  std::fprintf(stderr,
+               "usage: stress [--threads N] [--millis M] [--filter name]\n");
+  std::exit(2);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  size_t max_threads = std::max(2u, std::thread::hardware_concurrency());
+  std::chrono::milliseconds duration(200);
+  std::string filter;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 == argc) {
+      usage();
+    }
+    if (!std::strcmp(argv[i], "--threads")) {
+      max_threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (!std::strcmp(argv[i], "--millis")) {
+      duration =
+          std::chrono::milliseconds(std::strtoul(argv[++i], nullptr, 10));
+    } else if (!std::strcmp(argv[i], "--filter")) {
+      filter = argv[++i];
+    } else {
+      usage();
+    }
+  }
+  if (max_threads == 0) {
+    usage();
+  }
+
+  std::vector<workload> workloads{copy_storm(),        lock_expire(),
+                                  make_free_churn(),   cross_thread_free(),
+                                  publish_read(false), publish_read(true)};
+  std::printf("%-20s %8s %12s %10s %10s\n", "workload", "threads", "Mops/s",
+              "p50 ns", "p99 ns");
+  bool all_ok = true;
+  for (const workload& w : workloads) {
+    if (std::string(w.name).find(filter) == std::string::npos) {
+      continue;
+    }
+    for (size_t threads = 1;; threads = std::min(threads * 2, max_threads)) {
+      run_report r = run(w, threads, duration);
+      std::printf("%-20s %8zu %12.2f %10.0f %10.0f%s\n", w.name, threads,
+                  r.mops_per_s, r.p50_ns, r.p99_ns, r.ok ? "" : "  FAILED");
+      all_ok = all_ok && r.ok;
+      if (threads == max_threads) {
+        break;
+      }
+    }
+  }
+  return all_ok ? 0 : 1;
+}
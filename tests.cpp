@@ -1,6 +1,23 @@
+#include "atomic-shared-ptr.h"
+#include "compact-shared-ptr.h"
+#include "cow-ptr.h"
+#include "deferred-reclaim.h"
+#include "intrusive-ptr.h"
+#include "local-ref.h"
+#include "refcount-stats.h"
+#include "shared-ptr-ranges.h"
 #include "shared-ptr.h"
 #include "tests-extra/test-object.h"
 #include <gtest/gtest.h>
+#include <array>
+#include <atomic>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 TEST(shared_ptr_testing, default_ctor) {
   shared_ptr<test_object> p;
@@ -30,6 +47,13 @@ TEST(shared_ptr_testing, ptr_ctor_non_empty_nullptr) {
   EXPECT_EQ(1, p.use_count());
 }
 
+TEST(shared_ptr_testing, ptr_ctor_const) {
+  shared_ptr<const int> p(new const int(42));
+  EXPECT_EQ(42, *p);
+  p.reset(new const int(43), std::default_delete<const int>());
+  EXPECT_EQ(43, *p);
+}
+
 TEST(shared_ptr_testing, copy_ctor) {
   test_object::no_new_instances_guard g;
   shared_ptr<test_object> p(new test_object(42));
@@ -199,6 +223,187 @@ TEST(shared_ptr_testing, move_assignment_operator_self_nullptr) {
   EXPECT_FALSE(static_cast<bool>(p));
 }
 
+static_assert(std::is_nothrow_move_constructible_v<shared_ptr<int>>);
+static_assert(std::is_nothrow_move_assignable_v<shared_ptr<int>>);
+static_assert(std::is_nothrow_swappable_v<shared_ptr<int>>);
+static_assert(std::is_nothrow_move_constructible_v<weak_ptr<int>>);
+static_assert(std::is_nothrow_swappable_v<weak_ptr<int>>);
+
+namespace {
+struct derived_object : test_object {
+  using test_object::test_object;
+};
+} // namespace
+
+TEST(shared_ptr_testing, converting_move_ctor) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<derived_object> p = make_shared<derived_object>(42);
+  derived_object* raw = p.get();
+  shared_ptr<test_object> q = std::move(p);
+  EXPECT_FALSE(static_cast<bool>(p));
+  EXPECT_EQ(raw, q.get());
+  EXPECT_EQ(1, q.use_count());
+}
+
+TEST(shared_ptr_testing, converting_move_assignment) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<derived_object> p = make_shared<derived_object>(42);
+  shared_ptr<test_object> q = make_shared<test_object>(43);
+  q = std::move(p);
+  EXPECT_FALSE(static_cast<bool>(p));
+  EXPECT_EQ(42, *q);
+  EXPECT_EQ(1, q.use_count());
+}
+
+TEST(shared_ptr_testing, move_assignment_operator_same_block) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object> p = make_shared<test_object>(42);
+  shared_ptr<test_object> q = p;
+  p = std::move(q);
+  EXPECT_FALSE(static_cast<bool>(q));
+  EXPECT_EQ(1, p.use_count());
+}
+
+TEST(shared_ptr_testing, aliasing_move_ctor) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<std::pair<test_object, test_object>> p =
+      make_shared<std::pair<test_object, test_object>>(42, 43);
+  auto* second = &p->second;
+  shared_ptr<test_object> q(std::move(p), second);
+  EXPECT_FALSE(static_cast<bool>(p));
+  EXPECT_EQ(43, *q);
+  EXPECT_EQ(1, q.use_count());
+}
+
+namespace {
+struct base {
+  virtual ~base() = default;
+};
+
+struct derived : base {
+  int value = 42;
+};
+
+struct other_derived : base {};
+
+struct virtually_derived : virtual base {};
+} // namespace
+
+static_assert(detail::is_plain_upcast_v<derived, base>);
+static_assert(detail::is_plain_upcast_v<derived, const void>);
+static_assert(!detail::is_plain_upcast_v<virtually_derived, base>);
+
+TEST(shared_ptr_testing, pointer_casts) {
+  shared_ptr<base> b = make_shared<derived>();
+  shared_ptr<derived> d = static_pointer_cast<derived>(b);
+  EXPECT_EQ(42, d->value);
+  EXPECT_EQ(2, b.use_count());
+  EXPECT_FALSE(dynamic_pointer_cast<other_derived>(b));
+  EXPECT_EQ(d, dynamic_pointer_cast<derived>(b));
+  shared_ptr<const derived> c = d;
+  EXPECT_EQ(d, const_pointer_cast<derived>(c));
+  EXPECT_EQ(3, b.use_count());
+}
+
+TEST(shared_ptr_testing, pointer_casts_move) {
+  shared_ptr<base> b = make_shared<derived>();
+  shared_ptr<base> keep = b;
+  shared_ptr<derived> d = static_pointer_cast<derived>(std::move(b));
+  EXPECT_FALSE(static_cast<bool>(b));
+  EXPECT_EQ(2, d.use_count());
+
+  shared_ptr<base> bb = d;
+  EXPECT_FALSE(dynamic_pointer_cast<other_derived>(std::move(bb)));
+  EXPECT_TRUE(static_cast<bool>(bb));
+  shared_ptr<derived> dd = dynamic_pointer_cast<derived>(std::move(bb));
+  EXPECT_FALSE(static_cast<bool>(bb));
+  EXPECT_EQ(3, dd.use_count());
+
+  shared_ptr<const derived> c = std::move(dd);
+  shared_ptr<derived> m = const_pointer_cast<derived>(std::move(c));
+  EXPECT_FALSE(static_cast<bool>(c));
+  EXPECT_EQ(3, m.use_count());
+}
+
+TEST(shared_ptr_testing, weak_ptr_converting_ctors) {
+  shared_ptr<derived> d = make_shared<derived>();
+  weak_ptr<base> from_shared = d;
+  weak_ptr<derived> w = d;
+  weak_ptr<base> from_weak = w;
+  weak_ptr<base> from_moved = std::move(w);
+  EXPECT_EQ(d, from_shared.lock());
+  EXPECT_EQ(d, from_weak.lock());
+  EXPECT_EQ(d, from_moved.lock());
+  EXPECT_FALSE(w.lock());
+  EXPECT_EQ(1, d.use_count());
+}
+
+TEST(shared_ptr_testing, weak_ptr_to_virtual_base) {
+  shared_ptr<virtually_derived> d = make_shared<virtually_derived>();
+  weak_ptr<virtually_derived> w = d;
+  weak_ptr<base> alive = w;
+  EXPECT_EQ(static_cast<base*>(d.get()), alive.lock().get());
+  d.reset();
+  // converting an expired pointer does not touch the dead object
+  weak_ptr<base> expired = w;
+  EXPECT_FALSE(expired.lock());
+}
+
+TEST(shared_ptr_testing, weak_ptr_expired) {
+  shared_ptr<int> p = make_shared<int>(42);
+  weak_ptr<int> w = p;
+  EXPECT_FALSE(w.expired());
+  EXPECT_EQ(1, w.use_count());
+  p.reset();
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(0, w.use_count());
+  EXPECT_TRUE(weak_ptr<int>().expired());
+}
+
+TEST(shared_ptr_testing, owner_before) {
+  auto pair = make_shared<std::pair<int, int>>(1, 2);
+  shared_ptr<int> first(pair, &pair->first);
+  shared_ptr<int> second(pair, &pair->second);
+  shared_ptr<int> other = make_shared<int>(3);
+  weak_ptr<int> w = second;
+  EXPECT_FALSE(first == second);
+  EXPECT_FALSE(first.owner_before(second));
+  EXPECT_FALSE(second.owner_before(first));
+  EXPECT_TRUE(first.owner_equal(w));
+  EXPECT_TRUE(w.owner_equal(pair));
+  EXPECT_FALSE(w.owner_equal(other));
+  EXPECT_NE(first.owner_before(other), other.owner_before(first));
+  EXPECT_EQ(first.owner_hash(), w.owner_hash());
+}
+
+TEST(shared_ptr_testing, owner_keyed_containers) {
+  shared_ptr<int> a = make_shared<int>(1);
+  shared_ptr<int> b = make_shared<int>(2);
+  weak_ptr<int> weak_a = a;
+  std::unordered_map<weak_ptr<int>, int, owner_hash, owner_equal> names;
+  names[a] = 1;
+  names[b] = 2;
+  names[weak_a] += 10;
+  EXPECT_EQ(2, names.size());
+  // an expired key can still be found
+  a.reset();
+  EXPECT_EQ(11, names[weak_a]);
+
+  std::set<weak_ptr<int>, owner_less> ordered{weak_a, b};
+  EXPECT_EQ(2, ordered.size());
+  EXPECT_EQ(1, ordered.count(b));
+  EXPECT_EQ(1, ordered.count(weak_a));
+}
+
+TEST(shared_ptr_testing, std_hash) {
+  shared_ptr<int> p = make_shared<int>(42);
+  EXPECT_EQ(std::hash<int*>()(p.get()), std::hash<shared_ptr<int>>()(p));
+  std::unordered_set<shared_ptr<int>> set{p};
+  EXPECT_EQ(1, set.count(p));
+  weak_ptr<int> w = p;
+  EXPECT_EQ(p.owner_hash(), std::hash<weak_ptr<int>>()(w));
+}
+
 TEST(shared_ptr_testing, weak_ptr_lock) {
   test_object::no_new_instances_guard g;
   shared_ptr<test_object> p(new test_object(42));
@@ -239,87 +444,1559 @@ TEST(shared_ptr_testing, make_shared_weak_ptr) {
   g.expect_no_instances();
 }
 
-#if defined(__has_feature)
-#if __has_feature(address_sanitizer)
-#define DISABLE_ALLOCATION_TESTS 1
-#endif
-#endif
+TEST(shared_ptr_testing, concurrent_copies) {
+  test_object::no_new_instances_guard g;
+  {
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    weak_ptr<test_object> w = p;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i != 4; ++i) {
+      threads.emplace_back([p, w] {
+        for (size_t j = 0; j != 10000; ++j) {
+          shared_ptr<test_object> q = p;
+          weak_ptr<test_object> r = w;
+          shared_ptr<test_object> s = std::move(q);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(1, p.use_count());
+    EXPECT_EQ(42, *p);
+  }
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, local_shared_ptr) {
+  test_object::no_new_instances_guard g;
+  local_weak_ptr<test_object> w;
+  {
+    local_shared_ptr<test_object> p(new test_object(42));
+    local_shared_ptr<test_object> q = p;
+    w = q;
+    EXPECT_EQ(2, p.use_count());
+    EXPECT_TRUE(w.lock() == p);
+  }
+  g.expect_no_instances();
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, make_local_shared) {
+  test_object::no_new_instances_guard g;
+  local_shared_ptr<test_object> p = make_local_shared<test_object>(42);
+  local_shared_ptr<test_object const> q = p;
+  EXPECT_EQ(42, *q);
+  EXPECT_EQ(2, q.use_count());
+}
 
-#ifndef DISABLE_ALLOCATION_TESTS
 namespace {
-size_t new_calls = 0;
-size_t delete_calls = 0;
+template <typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  explicit counting_allocator(size_t* allocated_) : allocated(allocated_) {}
+
+  template <typename U>
+  counting_allocator(const counting_allocator<U>& other)
+      : allocated(other.allocated) {}
+
+  T* allocate(size_t n) {
+    *allocated += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    *allocated -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const counting_allocator<U>& other) const {
+    return allocated == other.allocated;
+  }
+
+  size_t* allocated;
+};
+
+// counts the objects it constructs and has not destroyed yet
+template <typename T>
+struct constructing_allocator {
+  using value_type = T;
+
+  explicit constructing_allocator(int* live_) : live(live_) {}
+
+  template <typename U>
+  constructing_allocator(const constructing_allocator<U>& other)
+      : live(other.live) {}
+
+  T* allocate(size_t n) { return std::allocator<T>().allocate(n); }
+
+  void deallocate(T* p, size_t n) { std::allocator<T>().deallocate(p, n); }
+
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    ++*live;
+  }
+
+  template <typename U>
+  void destroy(U* p) {
+    p->~U();
+    --*live;
+  }
+
+  template <typename U>
+  bool operator==(const constructing_allocator<U>& other) const {
+    return live == other.live;
+  }
+
+  int* live;
+};
+
+void delete_test_object(test_object* p) {
+  delete p;
+}
 } // namespace
-void* operator new(std::size_t count) {
-  new_calls += 1;
-  return malloc(count);
+
+TEST(shared_ptr_testing, allocate_shared) {
+  test_object::no_new_instances_guard g;
+  size_t allocated = 0;
+  weak_ptr<test_object> w;
+  {
+    shared_ptr<test_object> p = allocate_shared<test_object>(
+        counting_allocator<test_object>(&allocated), 42);
+    w = p;
+    EXPECT_EQ(42, *p);
+    EXPECT_GT(allocated, sizeof(test_object));
+  }
+  g.expect_no_instances();
+  EXPECT_GT(allocated, 0);
+  w = weak_ptr<test_object>();
+  EXPECT_EQ(0, allocated);
 }
 
-void operator delete(void* ptr) noexcept {
-  delete_calls += 1;
-  free(ptr);
+TEST(shared_ptr_testing, ptr_ctor_allocator) {
+  test_object::no_new_instances_guard g;
+  size_t allocated = 0;
+  {
+    shared_ptr<test_object> p(new test_object(42), &delete_test_object,
+                              counting_allocator<int>(&allocated));
+    EXPECT_EQ(42, *p);
+    EXPECT_GT(allocated, 0);
+    p.reset(new test_object(43), std::default_delete<test_object>(),
+            counting_allocator<char>(&allocated));
+    EXPECT_EQ(43, *p);
+  }
+  EXPECT_EQ(0, allocated);
 }
 
-void operator delete(void* ptr, size_t) noexcept {
-  delete_calls += 1;
-  free(ptr);
+TEST(shared_ptr_testing, allocate_shared_separate) {
+  test_object::no_new_instances_guard g;
+  size_t allocated = 0;
+  size_t allocated_with_object = 0;
+  weak_ptr<test_object> w;
+  {
+    shared_ptr<test_object> p = allocate_shared_separate<test_object>(
+        counting_allocator<test_object>(&allocated), 42);
+    w = p;
+    EXPECT_EQ(42, *p);
+    allocated_with_object = allocated;
+  }
+  g.expect_no_instances();
+  // only the control block is left
+  EXPECT_EQ(allocated_with_object - sizeof(test_object), allocated);
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
+  w = weak_ptr<test_object>();
+  EXPECT_EQ(0, allocated);
 }
 
-TEST(shared_ptr_testing, weak_ptr_allocations) {
-  size_t new_calls_before = new_calls;
-  size_t delete_calls_before = delete_calls;
-  int* i_p = new int(1337);
-  weak_ptr<int> w_p;
+TEST(shared_ptr_testing, make_shared_const) {
+  shared_ptr<const int> p = make_shared<const int>(42);
+  EXPECT_EQ(42, *p);
+  EXPECT_EQ(43, *make_shared_padded<const int>(43));
+  EXPECT_EQ(44, *make_shared_separate<const int>(44));
+  EXPECT_EQ(45, *make_compact_shared<const int>(45));
+}
+
+TEST(shared_ptr_testing, make_shared_padded) {
+  test_object::no_new_instances_guard g;
+  weak_ptr<test_object> w;
   {
-    shared_ptr<int> s_p(i_p);
-    w_p = s_p;
+    shared_ptr<test_object> p = make_shared_padded<test_object>(42);
+    w = p;
+    EXPECT_EQ(42, *p);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(p.get()) %
+                     detail::cache_line_size);
   }
-  const auto new_calls_after = new_calls;
-  const auto delete_calls_after = delete_calls;
-  EXPECT_EQ(new_calls_after - new_calls_before, 2);
-  EXPECT_EQ(delete_calls_after - delete_calls_before, 1);
-  EXPECT_FALSE(w_p.lock());
+  g.expect_no_instances();
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
 }
 
-TEST(shared_ptr_testing, make_shared_weak_ptr_allocations) {
-  size_t new_calls_before = new_calls;
-  size_t delete_calls_before = delete_calls;
-  weak_ptr<int> w_p;
+TEST(shared_ptr_testing, pool_allocator) {
+  test_object::no_new_instances_guard g;
+  weak_ptr<test_object> w;
   {
-    shared_ptr<int> s_p = make_shared<int>(42);
-    w_p = s_p;
+    shared_ptr<test_object> p =
+        allocate_shared<test_object>(pool_allocator<test_object>(), 42);
+    shared_ptr<test_object> q(new test_object(43),
+                              std::default_delete<test_object>(),
+                              pool_allocator<test_object>());
+    w = p;
+    EXPECT_EQ(42, *p);
+    EXPECT_EQ(43, *q);
   }
-  const auto new_calls_after = new_calls;
-  const auto delete_calls_after = delete_calls;
-  EXPECT_EQ(new_calls_after - new_calls_before, 1);
-  EXPECT_EQ(delete_calls_after - delete_calls_before, 0);
-  EXPECT_FALSE(w_p.lock());
+  g.expect_no_instances();
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
 }
 
-TEST(shared_ptr_testing, allocations) {
-  size_t new_calls_before = new_calls;
-  size_t delete_calls_before = delete_calls;
-  int* i_p = new int(1337);
+TEST(shared_ptr_testing, pool_allocator_cross_thread) {
+  std::vector<shared_ptr<int>> ptrs;
+  for (int i = 0; i != 1000; ++i) {
+    ptrs.push_back(allocate_shared<int>(pool_allocator<int>(), i));
+  }
+  // blocks allocated here are freed by another thread
+  std::thread([ptrs = std::move(ptrs)]() mutable { ptrs.clear(); }).join();
+  for (int i = 0; i != 1000; ++i) {
+    ptrs.push_back(allocate_shared<int>(pool_allocator<int>(), i));
+    EXPECT_EQ(i, *ptrs.back());
+  }
+}
+
+namespace {
+// made before the thread's first pool allocation, so destroyed after the
+// thread's block cache
+struct late_holder {
+  ~late_holder() {
+    p.reset();
+    // allocating again while the thread exits
+    *seen = *allocate_shared<int>(pool_allocator<int>(), 43);
+  }
+
+  shared_ptr<int> p;
+  int* seen{nullptr};
+};
+} // namespace
+
+TEST(shared_ptr_testing, pool_allocator_thread_exit) {
+  weak_ptr<int> w;
+  int seen = 0;
+  std::thread([&w, &seen] {
+    thread_local late_holder holder;
+    holder.seen = &seen;
+    holder.p = allocate_shared<int>(pool_allocator<int>(), 42);
+    w = holder.p;
+  }).join();
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(43, seen);
+  // what the exiting thread freed is still good to allocate
+  std::vector<shared_ptr<int>> ptrs;
+  for (int i = 0; i != 100; ++i) {
+    ptrs.push_back(allocate_shared<int>(pool_allocator<int>(), i));
+    EXPECT_EQ(i, *ptrs.back());
+  }
+}
+
+TEST(shared_ptr_testing, blocks_have_no_vptr) {
+  // counters + manager + the payload itself
+  using block =
+      detail::obj_block<void*, std::allocator<void*>, atomic_counting>;
+  EXPECT_FALSE(std::is_polymorphic_v<block>);
+  EXPECT_EQ(sizeof(uint64_t) + 2 * sizeof(void*), sizeof(block));
+}
+
+namespace {
+struct self_aware : enable_shared_from_this<self_aware> {
+  explicit self_aware(int value_) : value(value_) {}
+
+  int value;
+};
+
+struct derived_self_aware : self_aware {
+  derived_self_aware() : self_aware(43) {}
+};
+} // namespace
+
+TEST(shared_ptr_testing, shared_from_this) {
+  shared_ptr<self_aware> p = make_shared<self_aware>(42);
+  shared_ptr<self_aware> q = p->shared_from_this();
+  EXPECT_TRUE(p == q);
+  EXPECT_EQ(2, p.use_count());
+  shared_ptr<const self_aware> c = std::as_const(*p).shared_from_this();
+  EXPECT_EQ(42, c->value);
+  EXPECT_EQ(3, p.use_count());
+}
+
+TEST(shared_ptr_testing, shared_from_this_ptr_ctor) {
+  weak_ptr<self_aware> w;
   {
-    shared_ptr<int> p(i_p);
-    EXPECT_EQ(*i_p, *p);
+    shared_ptr<self_aware> p(new derived_self_aware());
+    w = p->weak_from_this();
+    EXPECT_TRUE(w.lock() == p);
+    EXPECT_TRUE(p->shared_from_this() == p);
+    EXPECT_EQ(1, p.use_count());
   }
-  const auto new_calls_after = new_calls;
-  const auto delete_calls_after = delete_calls;
-  EXPECT_EQ(new_calls_after - new_calls_before, 2);
-  EXPECT_EQ(delete_calls_after - delete_calls_before, 2);
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
 }
 
-TEST(shared_ptr_testing, make_shared_allocations) {
-  size_t new_calls_before = new_calls;
-  size_t delete_calls_before = delete_calls;
+TEST(shared_ptr_testing, shared_from_this_not_owned) {
+  self_aware s(42);
+  EXPECT_THROW(s.shared_from_this(), std::bad_weak_ptr);
+  EXPECT_FALSE(static_cast<bool>(s.weak_from_this().lock()));
+}
+
+namespace {
+// counts what happens to it, to check it is moved into the block just once
+struct counting_deleter {
+  counting_deleter(int* deletes_, int* copies_)
+      : deletes(deletes_), copies(copies_) {}
+
+  counting_deleter(const counting_deleter& other)
+      : deletes(other.deletes), copies(other.copies) {
+    ++*copies;
+  }
+
+  counting_deleter(counting_deleter&&) noexcept = default;
+
+  template <typename T>
+  void operator()(T* p) const {
+    ++*deletes;
+    delete p;
+  }
+
+  int* deletes;
+  int* copies;
+};
+} // namespace
+
+TEST(shared_ptr_testing, unique_ptr_ctor) {
+  test_object::no_new_instances_guard g;
+  auto u = std::make_unique<derived_object>(42);
+  derived_object* raw = u.get();
+  shared_ptr<test_object> p(std::move(u));
+  EXPECT_FALSE(u);
+  EXPECT_EQ(raw, p.get());
+  EXPECT_EQ(1, p.use_count());
+
+  shared_ptr<self_aware> s(std::make_unique<derived_self_aware>());
+  EXPECT_TRUE(s->shared_from_this() == s);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_deleter) {
+  int deletes = 0;
+  int copies = 0;
+  std::unique_ptr<int, counting_deleter> u(new int(42),
+                                           counting_deleter(&deletes, &copies));
   {
-    shared_ptr<int> p = make_shared<int>(42);
+    shared_ptr<int> p(std::move(u));
     EXPECT_EQ(42, *p);
+    EXPECT_EQ(0, deletes);
   }
-  const auto new_calls_after = new_calls;
-  const auto delete_calls_after = delete_calls;
-  EXPECT_EQ(new_calls_after - new_calls_before, 1);
-  EXPECT_EQ(delete_calls_after - delete_calls_before, 1);
+  EXPECT_EQ(1, deletes);
+  EXPECT_EQ(0, copies);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_reference_deleter) {
+  int deletes = 0;
+  int copies = 0;
+  counting_deleter d(&deletes, &copies);
+  std::unique_ptr<int, counting_deleter&> u(new int(42), d);
+  shared_ptr<int> p(std::move(u));
+  // the block refers to `d`, so it has to see a change to it
+  int other_deletes = 0;
+  d.deletes = &other_deletes;
+  p.reset();
+  EXPECT_EQ(0, deletes);
+  EXPECT_EQ(1, other_deletes);
+  EXPECT_EQ(0, copies);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_array) {
+  test_object::no_new_instances_guard g;
+  std::unique_ptr<test_object[]> u(new test_object[3]{1, 2, 3});
+  shared_ptr<test_object[]> p(std::move(u));
+  EXPECT_EQ(3, p[2]);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_const) {
+  shared_ptr<const int> p(std::make_unique<const int>(42));
+  EXPECT_EQ(42, *p);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_empty) {
+  shared_ptr<int> p(std::unique_ptr<int>(nullptr));
+  EXPECT_FALSE(p);
+  EXPECT_EQ(0, p.use_count());
+}
+
+TEST(shared_ptr_testing, unique_ptr_assignment) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object> p = make_shared<test_object>(42);
+  weak_ptr<test_object> w = p;
+  p = std::make_unique<test_object>(43);
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(43, *p);
+  p = std::unique_ptr<test_object>();
+  EXPECT_FALSE(p);
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, shared_from_this_copy) {
+  shared_ptr<self_aware> p = make_shared<self_aware>(42);
+  self_aware copy = *p;
+  EXPECT_THROW(copy.shared_from_this(), std::bad_weak_ptr);
+}
+
+namespace {
+struct intrusive_object : intrusive_hook<> {
+  explicit intrusive_object(int value_) : value(value_) {}
+
+  int value;
+};
+} // namespace
+
+TEST(shared_ptr_testing, intrusive_ptr) {
+  static_assert(sizeof(intrusive_ptr<intrusive_object>) == sizeof(void*));
+  intrusive_ptr<intrusive_object> p = make_intrusive<intrusive_object>(42);
+  EXPECT_EQ(42, p->value);
+  EXPECT_EQ(1, p.use_count());
+  intrusive_ptr<intrusive_object> q(p.get());
+  EXPECT_TRUE(p == q);
+  EXPECT_EQ(2, p.use_count());
+  q.reset();
+  EXPECT_FALSE(static_cast<bool>(q));
+  EXPECT_EQ(1, p.use_count());
+}
+
+TEST(shared_ptr_testing, intrusive_ptr_shared_and_weak) {
+  weak_ptr<intrusive_object> w;
+  {
+    shared_ptr<intrusive_object> s(new intrusive_object(42));
+    intrusive_ptr<intrusive_object> p(s);
+    EXPECT_EQ(2, s.use_count());
+    shared_ptr<intrusive_object> t = p.to_shared();
+    EXPECT_TRUE(s == t);
+    EXPECT_EQ(3, s.use_count());
+    w = p.to_weak();
+    intrusive_ptr<intrusive_object> q(std::move(t));
+    EXPECT_EQ(3, s.use_count());
+  }
+  EXPECT_FALSE(static_cast<bool>(w.lock()));
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr) {
+  test_object::no_new_instances_guard g;
+  {
+    atomic_shared_ptr<test_object> a;
+    EXPECT_FALSE(static_cast<bool>(a.load()));
+    shared_ptr<test_object> p = make_shared<test_object>(42);
+    a.store(p);
+    EXPECT_TRUE(a.load() == p);
+    EXPECT_EQ(3, a.load().use_count());
+    shared_ptr<test_object> q = a.exchange(make_shared<test_object>(43));
+    EXPECT_TRUE(q == p);
+    EXPECT_EQ(43, *a.load());
+    EXPECT_EQ(2, p.use_count());
+  }
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_compare_exchange) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object> p = make_shared<test_object>(42);
+  shared_ptr<test_object> q = make_shared<test_object>(43);
+  atomic_shared_ptr<test_object> a(p);
+
+  shared_ptr<test_object> expected = q;
+  EXPECT_FALSE(a.compare_exchange_strong(expected, q));
+  EXPECT_TRUE(expected == p);
+  EXPECT_TRUE(a.compare_exchange_strong(expected, q));
+  EXPECT_TRUE(a.load() == q);
+  EXPECT_EQ(2, p.use_count());
+
+  // same pointer, different owner
+  shared_ptr<test_object> alias(p, q.get());
+  expected = alias;
+  EXPECT_FALSE(a.compare_exchange_strong(expected, nullptr));
+  EXPECT_TRUE(expected == q);
+  EXPECT_TRUE(a.compare_exchange_strong(expected, nullptr));
+  EXPECT_FALSE(static_cast<bool>(a.load()));
+}
+
+namespace {
+struct snapshot {
+  explicit snapshot(size_t version_) : version(version_), check(~version_) {
+    alive.fetch_add(1);
+  }
+
+  ~snapshot() {
+    check = 0;
+    alive.fetch_sub(1);
+  }
+
+  size_t version;
+  size_t check;
+
+  static std::atomic<int> alive;
+};
+
+std::atomic<int> snapshot::alive{0};
+} // namespace
+
+TEST(shared_ptr_testing, atomic_shared_ptr_concurrent) {
+  {
+    atomic_shared_ptr<snapshot> current(make_shared<snapshot>(0));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i != 3; ++i) {
+      readers.emplace_back([&] {
+        size_t last = 0;
+        while (!done.load()) {
+          shared_ptr<snapshot> s = current.load();
+          EXPECT_EQ(~s->version, s->check);
+          EXPECT_LE(last, s->version);
+          last = s->version;
+        }
+      });
+    }
+    std::thread cas_writer([&] {
+      for (size_t i = 0; i != 2000; ++i) {
+        shared_ptr<snapshot> expected = current.load();
+        current.compare_exchange_strong(expected, expected);
+      }
+    });
+    for (size_t i = 1; i != 5000; ++i) {
+      current.store(make_shared<snapshot>(i));
+    }
+    cas_writer.join();
+    done.store(true);
+    for (auto& t : readers) {
+      t.join();
+    }
+    EXPECT_EQ(4999, current.load()->version);
+  }
+  EXPECT_EQ(0, snapshot::alive.load());
+}
+
+namespace {
+struct packet {
+  int size = 7;
+  unsigned char payload[1024];
+};
+} // namespace
+
+TEST(shared_ptr_testing, make_shared_for_overwrite) {
+  shared_ptr<packet> p = make_shared_for_overwrite<packet>();
+  EXPECT_EQ(7, p->size);
+  p->payload[1023] = 42;
+  EXPECT_EQ(42, p->payload[1023]);
+  shared_ptr<int> q = make_shared_for_overwrite<int>();
+  *q = 42;
+  EXPECT_EQ(42, *q);
+}
+
+TEST(shared_ptr_testing, make_shared_for_overwrite_const) {
+  shared_ptr<const packet> p = make_shared_for_overwrite<const packet>();
+  EXPECT_EQ(7, p->size);
+  shared_ptr<const int> q = make_shared_for_overwrite<const int>();
+  EXPECT_TRUE(q);
+}
+
+TEST(shared_ptr_testing, allocate_shared_for_overwrite) {
+  size_t allocated = 0;
+  weak_ptr<packet> w;
+  {
+    auto p = allocate_shared_for_overwrite<packet>(
+        counting_allocator<packet>(&allocated));
+    w = p;
+    EXPECT_GT(allocated, sizeof(packet));
+    EXPECT_EQ(7, p->size);
+  }
+  EXPECT_FALSE(w.lock());
+  w = weak_ptr<packet>();
+  EXPECT_EQ(0, allocated);
+}
+
+TEST(shared_ptr_testing, allocate_shared_for_overwrite_bypasses_allocator) {
+  int live = 0;
+  {
+    auto p = allocate_shared<packet>(constructing_allocator<packet>(&live));
+    EXPECT_EQ(1, live);
+    auto a = allocate_shared<packet[]>(constructing_allocator<packet>(&live),
+                                       3);
+    EXPECT_EQ(4, live);
+  }
+  EXPECT_EQ(0, live);
+  {
+    // made without the allocator, so not destroyed through it either
+    auto p = allocate_shared_for_overwrite<packet>(
+        constructing_allocator<packet>(&live));
+    auto a = allocate_shared_for_overwrite<packet[]>(
+        constructing_allocator<packet>(&live), 3);
+    auto b = allocate_shared_for_overwrite<packet[2]>(
+        constructing_allocator<packet>(&live));
+    EXPECT_EQ(7, p->size);
+    EXPECT_EQ(7, a[2].size);
+    EXPECT_EQ(7, b[1].size);
+    EXPECT_EQ(0, live);
+  }
+  EXPECT_EQ(0, live);
+}
+
+TEST(shared_ptr_testing, array_ptr_ctor) {
+  shared_ptr<int[]> p(new int[5]{1, 2, 3, 4, 5});
+  EXPECT_EQ(1, p[0]);
+  EXPECT_EQ(5, p[4]);
+  p[2] = 42;
+  EXPECT_EQ(42, p.get()[2]);
+}
+
+TEST(shared_ptr_testing, make_shared_array) {
+  test_object::no_new_instances_guard g;
+  weak_ptr<test_object[]> w;
+  {
+    shared_ptr<test_object[]> p = make_shared<test_object[]>(3, 42);
+    w = p;
+    EXPECT_EQ(42, p[0]);
+    EXPECT_EQ(42, p[2]);
+  }
+  g.expect_no_instances();
+  EXPECT_FALSE(w.lock());
+}
+
+TEST(shared_ptr_testing, make_shared_array_value_init) {
+  shared_ptr<int[]> p = make_shared<int[]>(100);
+  for (int i = 0; i != 100; ++i) {
+    EXPECT_EQ(0, p[i]);
+  }
+  EXPECT_TRUE(make_shared<int[]>(0));
+}
+
+TEST(shared_ptr_testing, make_shared_array_of_arrays) {
+  shared_ptr<int[][2]> p = make_shared<int[][2]>(3, {1, 2});
+  for (int i = 0; i != 3; ++i) {
+    EXPECT_EQ(1, p[i][0]);
+    EXPECT_EQ(2, p[i][1]);
+  }
+}
+
+TEST(shared_ptr_testing, void_ptr) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object> p = make_shared<test_object>(42);
+  shared_ptr<void> v = p;
+  EXPECT_EQ(p.get(), v.get());
+  EXPECT_EQ(2, v.use_count());
+  p.reset();
+  v.reset();
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, make_shared_const_array) {
+  shared_ptr<const int[]> p = make_shared<const int[]>(3, 42);
+  EXPECT_EQ(42, p[2]);
+  shared_ptr<const int[2]> q = make_shared<const int[2]>();
+  EXPECT_EQ(0, q[1]);
+  shared_ptr<const int[]> r(new const int[2]{1, 2});
+  EXPECT_EQ(2, r[1]);
+  EXPECT_TRUE(make_shared_for_overwrite<const int[]>(4));
+}
+
+TEST(shared_ptr_testing, make_shared_bounded_array) {
+  shared_ptr<int[4]> p = make_shared<int[4]>();
+  EXPECT_EQ(0, p[3]);
+  shared_ptr<double[4]> q = make_shared<double[4]>(0.5);
+  EXPECT_EQ(0.5, q[0]);
+  EXPECT_EQ(0.5, q[3]);
+  shared_ptr<int[]> r = make_shared_for_overwrite<int[]>(4);
+  shared_ptr<int[4]> s = make_shared_for_overwrite<int[4]>();
+  r[3] = s[3] = 7;
+  EXPECT_EQ(r[3], s[3]);
+}
+
+TEST(shared_ptr_testing, allocate_shared_array) {
+  test_object::no_new_instances_guard g;
+  size_t allocated = 0;
+  {
+    auto p = allocate_shared<test_object[]>(
+        counting_allocator<test_object>(&allocated), 10, 42);
+    EXPECT_GT(allocated, 10 * sizeof(test_object));
+    EXPECT_EQ(42, p[9]);
+  }
+  g.expect_no_instances();
+  EXPECT_EQ(0, allocated);
+}
+
+namespace {
+struct throws_on_third {
+  throws_on_third() {
+    if (++constructed == 3) {
+      throw std::runtime_error("third");
+    }
+    ++alive;
+  }
+
+  ~throws_on_third() {
+    --alive;
+  }
+
+  static inline int constructed = 0;
+  static inline int alive = 0;
+};
+} // namespace
+
+TEST(shared_ptr_testing, make_shared_array_throws) {
+  size_t allocated = 0;
+  EXPECT_THROW(allocate_shared<throws_on_third[]>(
+                   counting_allocator<throws_on_third>(&allocated), 5),
+               std::runtime_error);
+  EXPECT_EQ(0, throws_on_third::alive);
+  EXPECT_EQ(0, allocated);
+}
+
+TEST(shared_ptr_testing, make_shared_array_too_large) {
+  EXPECT_THROW(make_shared<int[]>(SIZE_MAX / 4 + 2), std::bad_array_new_length);
+  EXPECT_THROW(make_shared<int[][4]>(SIZE_MAX / 8),
+               std::bad_array_new_length);
+  EXPECT_THROW(make_shared_for_overwrite<char[]>(SIZE_MAX),
+               std::bad_array_new_length);
+}
+
+TEST(shared_ptr_testing, copy_shared) {
+  test_object::no_new_instances_guard g;
+  {
+    std::vector<shared_ptr<test_object>> blocks;
+    for (int i = 0; i != 20; ++i) {
+      blocks.push_back(make_shared<test_object>(i));
+    }
+    std::vector<shared_ptr<test_object>> v;
+    for (int i = 0; i != 1000; ++i) {
+      v.push_back(i % 7 == 0 ? nullptr : blocks[i % 20]);
+    }
+    std::vector<shared_ptr<test_object>> copy;
+    copy_shared(v.begin(), v.end(), std::back_inserter(copy));
+    ASSERT_EQ(v.size(), copy.size());
+    for (int i = 0; i != 1000; ++i) {
+      EXPECT_TRUE(v[i] == copy[i]);
+    }
+    for (int i = 0; i != 20; ++i) {
+      EXPECT_EQ(blocks[i].use_count(),
+                1 + 2 * std::count(v.begin(), v.end(), blocks[i]));
+    }
+    release_shared(copy.begin(), copy.end());
+    for (const auto& p : copy) {
+      EXPECT_FALSE(p);
+    }
+    release_shared(v.begin(), v.end());
+    for (int i = 0; i != 20; ++i) {
+      EXPECT_EQ(1, blocks[i].use_count());
+    }
+  }
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, release_shared_last_references) {
+  test_object::no_new_instances_guard g;
+  std::vector<shared_ptr<test_object>> v(10, make_shared<test_object>(42));
+  weak_ptr<test_object> w = v[0];
+  release_shared(v.begin(), v.end());
+  g.expect_no_instances();
+  EXPECT_FALSE(w.lock());
+}
+
+namespace {
+struct throwing_output {
+  using iterator_category = std::output_iterator_tag;
+  using value_type = void;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = void;
+
+  throwing_output& operator*() {
+    return *this;
+  }
+
+  throwing_output& operator=(shared_ptr<int> p) {
+    if (out->size() == limit) {
+      throw std::runtime_error("full");
+    }
+    out->push_back(std::move(p));
+    return *this;
+  }
+
+  throwing_output& operator++() {
+    return *this;
+  }
+
+  std::vector<shared_ptr<int>>* out;
+  size_t limit;
+};
+} // namespace
+
+TEST(shared_ptr_testing, copy_shared_throws) {
+  shared_ptr<int> p = make_shared<int>(42);
+  std::vector<shared_ptr<int>> v(5, p);
+  std::vector<shared_ptr<int>> copy;
+  EXPECT_THROW(copy_shared(v.begin(), v.end(), throwing_output{&copy, 3}),
+               std::runtime_error);
+  EXPECT_EQ(3, copy.size());
+  EXPECT_EQ(9, p.use_count());
+}
+
+TEST(shared_ptr_testing, weak_ptr_lock_concurrent_expiry) {
+  for (size_t round = 0; round != 200; ++round) {
+    auto p = make_shared<snapshot>(round);
+    weak_ptr<snapshot> w = p;
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i != 4; ++i) {
+      threads.emplace_back([&] {
+        while (!go.load()) {
+        }
+        // once lock() fails it never succeeds again
+        while (shared_ptr<snapshot> q = w.lock()) {
+          EXPECT_EQ(~q->version, q->check);
+        }
+        EXPECT_FALSE(w.lock());
+      });
+    }
+    go.store(true);
+    p.reset();
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+  EXPECT_EQ(0, snapshot::alive.load());
+}
+
+TEST(shared_ptr_testing, local_weak_ptr_lock) {
+  local_shared_ptr<int> p = make_local_shared<int>(42);
+  local_weak_ptr<int> w = p;
+  EXPECT_EQ(42, *w.lock());
+  EXPECT_EQ(1, p.use_count());
+  p.reset();
+  EXPECT_FALSE(w.lock());
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_borrow) {
+  atomic_shared_ptr<snapshot> current(make_shared<snapshot>(1));
+  {
+    borrowed_ptr<snapshot> b = current.borrow();
+    EXPECT_EQ(1, b->version);
+    // no reference taken: the holder's and the temporary's only
+    EXPECT_EQ(2, current.load().use_count());
+    current.store(make_shared<snapshot>(2));
+    // replaced, but still alive while borrowed
+    EXPECT_EQ(2, snapshot::alive.load());
+    EXPECT_EQ(~b->version, b->check);
+    EXPECT_EQ(2, current.borrow()->version);
+  }
+  EXPECT_EQ(1, snapshot::alive.load());
+  current.store(nullptr);
+  EXPECT_FALSE(current.borrow());
+  EXPECT_EQ(0, snapshot::alive.load());
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_borrow_nested) {
+  atomic_shared_ptr<int> current(make_shared<int>(42));
+  std::vector<borrowed_ptr<int>> borrows;
+  // more than there are hazard slots
+  for (int i = 0; i != 10; ++i) {
+    borrows.push_back(current.borrow());
+  }
+  current.store(make_shared<int>(43));
+  for (const auto& b : borrows) {
+    EXPECT_EQ(42, *b);
+  }
+}
+
+TEST(shared_ptr_testing, atomic_shared_ptr_borrow_concurrent) {
+  {
+    atomic_shared_ptr<snapshot> current(make_shared<snapshot>(0));
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i != 4; ++i) {
+      readers.emplace_back([&] {
+        size_t last = 0;
+        while (!done.load()) {
+          borrowed_ptr<snapshot> b = current.borrow();
+          EXPECT_EQ(~b->version, b->check);
+          EXPECT_LE(last, b->version);
+          last = b->version;
+        }
+      });
+    }
+    for (size_t v = 1; v != 5000; ++v) {
+      current.store(make_shared<snapshot>(v));
+    }
+    done.store(true);
+    for (auto& t : readers) {
+      t.join();
+    }
+  }
+  EXPECT_EQ(0, snapshot::alive.load());
+}
+
+TEST(shared_ptr_testing, compact_shared_ptr) {
+  static_assert(sizeof(compact_shared_ptr<test_object>) == sizeof(void*));
+  test_object::no_new_instances_guard g;
+  {
+    compact_shared_ptr<test_object> p = make_compact_shared<test_object>(42);
+    compact_shared_ptr<test_object> q = p;
+    EXPECT_EQ(42, *q);
+    EXPECT_EQ(2, p.use_count());
+    shared_ptr<test_object> s = p.to_shared();
+    EXPECT_EQ(p.get(), s.get());
+    EXPECT_EQ(3, s.use_count());
+    weak_ptr<test_object> w = q.to_weak();
+    p.reset();
+    q.reset();
+    EXPECT_TRUE(w.lock());
+    s.reset();
+    EXPECT_FALSE(w.lock());
+  }
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, compact_shared_ptr_from_shared) {
+  using point = std::pair<int, int>;
+  shared_ptr<point> made = make_shared<point>(1, 2);
+  EXPECT_TRUE(compact_shared_ptr<point>::fits(made));
+  compact_shared_ptr<point> c(made);
+  EXPECT_EQ(2, made.use_count());
+  compact_shared_ptr<point> moved(std::move(made));
+  EXPECT_FALSE(made);
+  EXPECT_EQ(2, c.use_count());
+  EXPECT_TRUE(c == moved);
+
+  // not from make_shared, or aliased
+  shared_ptr<int> owned(new int(42));
+  EXPECT_FALSE(compact_shared_ptr<int>::fits(owned));
+  shared_ptr<int> padded = make_shared_padded<int>(42);
+  EXPECT_FALSE(compact_shared_ptr<int>::fits(padded));
+  shared_ptr<int> made_int = make_shared<int>(42);
+  EXPECT_TRUE(compact_shared_ptr<int>::fits(made_int));
+  shared_ptr<int> alias(made_int, nullptr);
+  EXPECT_FALSE(compact_shared_ptr<int>::fits(alias));
+}
+
+TEST(shared_ptr_testing, deferred_delete) {
+  test_object::no_new_instances_guard g;
+  reclaimer r;
+  weak_ptr<test_object> w;
+  {
+    shared_ptr<test_object> p = make_shared_deferred<test_object>(r, 42);
+    w = p;
+  }
+  // expired, but not destroyed yet
+  EXPECT_FALSE(w.lock());
+  EXPECT_EQ(1, r.drain());
+  g.expect_no_instances();
+  EXPECT_EQ(0, r.drain());
+}
+
+TEST(shared_ptr_testing, deferred_delete_weak_gone_first) {
+  test_object::no_new_instances_guard g;
+  reclaimer r;
+  {
+    shared_ptr<test_object> p = make_shared_deferred<test_object>(r, 42);
+    weak_ptr<test_object> w = p;
+    p.reset();
+    EXPECT_FALSE(w.lock());
+  }
+  // the block outlives its last reference until the destructor has run
+  EXPECT_EQ(1, r.drain());
+  g.expect_no_instances();
+}
+
+namespace {
+struct graph_node {
+  explicit graph_node(shared_ptr<graph_node> next_, std::atomic<int>& alive_)
+      : next(std::move(next_)), alive(alive_) {
+    ++alive;
+  }
+
+  ~graph_node() {
+    --alive;
+  }
+
+  shared_ptr<graph_node> next;
+  std::atomic<int>& alive;
+};
+} // namespace
+
+TEST(shared_ptr_testing, deferred_delete_cascade) {
+  reclaimer r;
+  std::atomic<int> alive{0};
+  shared_ptr<graph_node> head;
+  for (int i = 0; i != 3; ++i) {
+    head = make_shared_deferred<graph_node>(r, std::move(head), alive);
+  }
+  head.reset();
+  EXPECT_EQ(3, alive);
+  // every destructor releases the next node, which waits for the next drain
+  EXPECT_EQ(1, r.drain());
+  EXPECT_EQ(2, alive);
+  EXPECT_EQ(1, r.drain());
+  EXPECT_EQ(1, r.drain());
+  EXPECT_EQ(0, alive);
+}
+
+TEST(shared_ptr_testing, deferred_delete_custom_deleter) {
+  reclaimer r;
+  int deleted = 0;
+  auto deleter = [&deleted](int* p) {
+    ++deleted;
+    delete p;
+  };
+  {
+    shared_ptr<int> p(new int(42),
+                      deferred_delete<int, decltype(deleter)>(r, deleter));
+  }
+  EXPECT_EQ(0, deleted);
+  r.drain();
+  EXPECT_EQ(1, deleted);
+}
+
+TEST(shared_ptr_testing, deferred_delete_background) {
+  reclaimer r;
+  std::atomic<int> alive{0};
+  r.start(std::chrono::milliseconds(1));
+  std::vector<std::thread> threads;
+  for (int i = 0; i != 4; ++i) {
+    threads.emplace_back([&] {
+      for (int j = 0; j != 1000; ++j) {
+        make_shared_deferred<graph_node>(r, nullptr, alive);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  while (alive != 0) {
+    std::this_thread::yield();
+  }
+  r.stop();
+  EXPECT_EQ(0, r.drain());
+}
+
+TEST(shared_ptr_testing, local_ref) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object> p = make_shared<test_object>(42);
+  weak_ptr<test_object> w = p;
+  local_ref<test_object> r = make_local_ref(std::move(p));
+  {
+    std::vector<local_ref<test_object>> copies(10, r);
+    EXPECT_EQ(11, r.local_count());
+    // all of them hold a single strong reference
+    EXPECT_EQ(1, w.use_count());
+    EXPECT_EQ(42, *copies.back());
+    EXPECT_TRUE(copies.front() == r);
+  }
+  EXPECT_EQ(1, r.local_count());
+  r.reset();
+  EXPECT_FALSE(w.lock());
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, local_ref_share) {
+  local_ref<int> r(make_shared<int>(42));
+  shared_ptr<int> s = r.share();
+  EXPECT_EQ(2, s.use_count());
+  int seen = 0;
+  std::thread([&seen, s = std::move(s)] { seen = *s; }).join();
+  EXPECT_EQ(42, seen);
+  // the local group's reference and the temporary
+  EXPECT_EQ(2, r.share().use_count());
+}
+
+TEST(shared_ptr_testing, local_ref_empty) {
+  local_ref<int> r;
+  EXPECT_FALSE(r);
+  EXPECT_FALSE(r.share());
+  EXPECT_EQ(0, r.local_count());
+  local_ref<int> n(shared_ptr<int>(nullptr));
+  EXPECT_FALSE(n);
+}
+
+TEST(shared_ptr_testing, cow_ptr_write_in_place) {
+  cow_ptr<std::vector<int>> c = make_cow<std::vector<int>>(3, 1);
+  const std::vector<int>* before = c.get();
+  EXPECT_TRUE(c.unique());
+  c.write().push_back(2);
+  EXPECT_EQ(before, c.get());
+  EXPECT_EQ(4, c->size());
+}
+
+TEST(shared_ptr_testing, cow_ptr_write_clones_shared) {
+  cow_ptr<std::vector<int>> c = make_cow<std::vector<int>>(3, 1);
+  cow_ptr<std::vector<int>> copy = c;
+  shared_ptr<const std::vector<int>> snap = c.snapshot();
+  EXPECT_FALSE(c.unique());
+  c.write()[0] = 42;
+  EXPECT_FALSE(c == copy);
+  EXPECT_EQ(42, (*c)[0]);
+  EXPECT_EQ(1, (*copy)[0]);
+  EXPECT_EQ(1, (*snap)[0]);
+  // the clone is c's alone
+  EXPECT_TRUE(c.unique());
+}
+
+TEST(shared_ptr_testing, cow_ptr_write_clones_watched) {
+  shared_ptr<int> p = make_shared<int>(1);
+  weak_ptr<int> w = p;
+  cow_ptr<int> c(std::move(p));
+  // w could be locked again while c modifies the object
+  EXPECT_FALSE(c.unique());
+  const int* before = c.get();
+  c.write() = 2;
+  EXPECT_NE(before, c.get());
+  EXPECT_EQ(2, *c);
+  // c let go of the original, w's only strong owner
+  EXPECT_TRUE(w.expired());
+}
+
+namespace {
+template <typename T, typename Policy>
+const void* block_type_of(const shared_ptr<T, Policy>& p) {
+  return detail::shared_ptr_access::block(p)->type_key();
+}
+} // namespace
+
+TEST(shared_ptr_testing, erased_deleter) {
+  test_object::no_new_instances_guard g;
+  int deletes = 0;
+  auto counted = [&deletes](test_object* p) {
+    ++deletes;
+    delete p;
+  };
+  {
+    shared_ptr<test_object> p(new test_object(42), counted, erase_deleter);
+    shared_ptr<test_object> q(new test_object(43), [](test_object* o) {
+      delete o;
+    }, erase_deleter);
+    shared_ptr<int> r(new int(44), std::default_delete<int>(), erase_deleter);
+    EXPECT_EQ(42, *p);
+    // one block type for all of them
+    EXPECT_EQ(block_type_of(p), block_type_of(q));
+    EXPECT_EQ(block_type_of(p), block_type_of(r));
+  }
+  EXPECT_EQ(1, deletes);
+}
+
+TEST(shared_ptr_testing, erased_deleter_outlives_object) {
+  shared_ptr<int> kept = make_shared<int>(1);
+  auto deleter = [kept](int* p) { delete p; };
+  weak_ptr<int> w;
+  {
+    shared_ptr<int> p(new int(42), std::move(deleter), erase_deleter);
+    w = p;
+    // `kept` and the deleter's copy, moved into the block
+    EXPECT_EQ(2, kept.use_count());
+  }
+  // like any deleter it lives as long as the block
+  EXPECT_EQ(2, kept.use_count());
+  w = weak_ptr<int>();
+  EXPECT_EQ(1, kept.use_count());
+}
+
+TEST(shared_ptr_testing, erased_deleter_too_large) {
+  std::array<int*, 4> seen{};
+  auto big = [seen](int* p) mutable {
+    seen[0] = p;
+    delete p;
+  };
+  shared_ptr<int> p(new int(42), big, erase_deleter);
+  shared_ptr<int> q(new int(43), [](int* i) { delete i; }, erase_deleter);
+  EXPECT_EQ(42, *p);
+  EXPECT_NE(block_type_of(p), block_type_of(q));
+}
+
+TEST(shared_ptr_testing, erased_deleter_array_and_hooks) {
+  test_object::no_new_instances_guard g;
+  shared_ptr<test_object[]> a(new test_object[2]{1, 2},
+                              std::default_delete<test_object[]>(),
+                              erase_deleter);
+  EXPECT_EQ(2, a[1]);
+  shared_ptr<self_aware> s(new self_aware(42),
+                           std::default_delete<self_aware>(), erase_deleter);
+  EXPECT_TRUE(s->shared_from_this() == s);
+}
+
+namespace {
+// constant-initialized, so usable from other globals' constructors
+constinit shared_ptr<test_object> empty_global;
+constinit weak_ptr<test_object> empty_weak_global;
+} // namespace
+
+TEST(shared_ptr_testing, constant_initialized_globals) {
+  EXPECT_FALSE(empty_global);
+  EXPECT_TRUE(empty_weak_global.expired());
+  static_assert(is_trivially_relocatable_v<shared_ptr<test_object>>);
+  static_assert(is_trivially_relocatable_v<weak_ptr<int[]>>);
+  static_assert(is_trivially_relocatable_v<intrusive_ptr<intrusive_hook<>>>);
+  static_assert(!is_trivially_relocatable_v<std::string>);
+}
+
+TEST(shared_ptr_testing, uninitialized_relocate) {
+  test_object::no_new_instances_guard g;
+  std::allocator<shared_ptr<test_object>> alloc;
+  shared_ptr<test_object>* from = alloc.allocate(3);
+  shared_ptr<test_object>* to = alloc.allocate(3);
+  std::uninitialized_fill_n(from, 2, make_shared<test_object>(42));
+  ::new (static_cast<void*>(from + 2)) shared_ptr<test_object>();
+  weak_ptr<test_object> w = from[0];
+
+  EXPECT_EQ(to + 3, uninitialized_relocate(from, from + 3, to));
+  alloc.deallocate(from, 3);
+  EXPECT_EQ(2, w.use_count());
+  EXPECT_EQ(42, *to[1]);
+  EXPECT_FALSE(to[2]);
+  std::destroy_n(to, 3);
+  alloc.deallocate(to, 3);
+  EXPECT_TRUE(w.expired());
+  g.expect_no_instances();
+}
+
+TEST(shared_ptr_testing, uninitialized_relocate_by_moves) {
+  std::allocator<std::string> alloc;
+  std::string* from = alloc.allocate(2);
+  std::string* to = alloc.allocate(2);
+  std::uninitialized_fill_n(from, 2, std::string(100, 'x'));
+  EXPECT_EQ(to + 2, uninitialized_relocate(from, from + 2, to));
+  alloc.deallocate(from, 2);
+  EXPECT_EQ(std::string(100, 'x'), to[1]);
+  std::destroy_n(to, 2);
+  alloc.deallocate(to, 2);
+}
+
+#ifdef SHARED_PTR_INSTRUMENT
+namespace {
+struct instrumented {
+  int value;
+};
+
+refcount_stats stats_of(const std::string& part) {
+  for (refcount_stats& s : collect_refcount_stats()) {
+    if (s.block_type.find(part) != std::string::npos) {
+      return s;
+    }
+  }
+  return {};
+}
+} // namespace
+
+TEST(shared_ptr_testing, refcount_stats) {
+  {
+    shared_ptr<instrumented> p = make_shared<instrumented>(instrumented{42});
+    shared_ptr<instrumented> q = p;
+    shared_ptr<instrumented> r = q;
+    weak_ptr<instrumented> w = p;
+    EXPECT_TRUE(w.lock());
+    q.reset();
+    r.reset();
+    p.reset();
+    EXPECT_FALSE(w.lock());
+  }
+  refcount_stats s = stats_of("obj_block<(anonymous namespace)::instrumented");
+  EXPECT_EQ(1, s.allocations);
+  EXPECT_EQ(1, s.frees);
+  EXPECT_EQ(2, s.strong_incs);
+  // the one from lock() included
+  EXPECT_EQ(4, s.strong_decs);
+  EXPECT_EQ(1, s.weak_incs);
+  EXPECT_EQ(1, s.weak_decs);
+  EXPECT_EQ(1, s.lock_hits);
+  EXPECT_EQ(1, s.lock_misses);
+  EXPECT_EQ(4, s.peak_use_count);
+}
+
+namespace {
+struct instrumented_throwing {
+  explicit instrumented_throwing(bool fail = false) {
+    if (fail || ++made == 3) {
+      throw std::runtime_error("construction failed");
+    }
+  }
+
+  static inline int made = 0;
+};
+} // namespace
+
+TEST(shared_ptr_testing, refcount_stats_throwing_constructor) {
+  make_shared<instrumented_throwing>();
+  EXPECT_THROW(make_shared<instrumented_throwing>(true), std::runtime_error);
+  refcount_stats s =
+      stats_of("obj_block<(anonymous namespace)::instrumented_throwing");
+  // the failed block is neither an allocation nor a free
+  EXPECT_EQ(1, s.allocations);
+  EXPECT_EQ(1, s.frees);
+
+  make_shared<instrumented_throwing[]>(1);
+  EXPECT_THROW(make_shared<instrumented_throwing[]>(2), std::runtime_error);
+  refcount_stats a =
+      stats_of("array_block<(anonymous namespace)::instrumented_throwing");
+  EXPECT_EQ(1, a.allocations);
+  EXPECT_EQ(1, a.frees);
+}
+
+TEST(shared_ptr_testing, refcount_stats_other_threads) {
+  std::thread([] {
+    auto p = make_shared<std::pair<instrumented, int>>();
+    auto q = p;
+  }).join();
+  refcount_stats s = stats_of("std::pair<(anonymous namespace)::instrumented");
+  EXPECT_EQ(1, s.allocations);
+  EXPECT_EQ(1, s.frees);
+  EXPECT_EQ(1, s.strong_incs);
+  EXPECT_EQ(2, s.peak_use_count);
+}
+#endif
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define DISABLE_ALLOCATION_TESTS 1
+#endif
+#endif
+
+// the instrumentation allocates its bookkeeping as it goes
+#ifdef SHARED_PTR_INSTRUMENT
+#define DISABLE_ALLOCATION_TESTS 1
+#endif
+
+// pooled blocks do not come from operator new
+#ifdef SHARED_PTR_POOL_BLOCKS
+#define DISABLE_ALLOCATION_TESTS 1
+#endif
+
+#ifndef DISABLE_ALLOCATION_TESTS
+namespace {
+// atomic: the concurrent tests allocate from several threads
+std::atomic<size_t> new_calls{0};
+std::atomic<size_t> delete_calls{0};
+
+void* counted_new(std::size_t count, std::size_t align) {
+  new_calls += 1;
+  // aligned_alloc wants a multiple of the alignment
+  void* p = align <= alignof(std::max_align_t)
+                ? std::malloc(count ? count : 1)
+                : std::aligned_alloc(align,
+                                     (count + align - 1) / align * align);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void counted_delete(void* ptr) noexcept {
+  if (ptr) {
+    delete_calls += 1;
+    std::free(ptr);
+  }
+}
+} // namespace
+
+// every replaceable form, so that none is left to the library's versions
+void* operator new(std::size_t count) {
+  return counted_new(count, alignof(std::max_align_t));
+}
+
+void* operator new[](std::size_t count) {
+  return counted_new(count, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t count, std::align_val_t align) {
+  return counted_new(count, static_cast<std::size_t>(align));
+}
+
+void* operator new[](std::size_t count, std::align_val_t align) {
+  return counted_new(count, static_cast<std::size_t>(align));
+}
+
+void* operator new(std::size_t count, const std::nothrow_t&) noexcept {
+  try {
+    return counted_new(count, alignof(std::max_align_t));
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](std::size_t count, const std::nothrow_t&) noexcept {
+  try {
+    return counted_new(count, alignof(std::max_align_t));
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* ptr) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  counted_delete(ptr);
+}
+
+TEST(shared_ptr_testing, weak_ptr_allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  int* i_p = new int(1337);
+  weak_ptr<int> w_p;
+  {
+    shared_ptr<int> s_p(i_p);
+    w_p = s_p;
+  }
+  const size_t new_calls_after = new_calls;
+  const size_t delete_calls_after = delete_calls;
+  EXPECT_EQ(new_calls_after - new_calls_before, 2);
+  EXPECT_EQ(delete_calls_after - delete_calls_before, 1);
+  EXPECT_FALSE(w_p.lock());
+}
+
+TEST(shared_ptr_testing, make_shared_weak_ptr_allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  weak_ptr<int> w_p;
+  {
+    shared_ptr<int> s_p = make_shared<int>(42);
+    w_p = s_p;
+  }
+  const size_t new_calls_after = new_calls;
+  const size_t delete_calls_after = delete_calls;
+  EXPECT_EQ(new_calls_after - new_calls_before, 1);
+  EXPECT_EQ(delete_calls_after - delete_calls_before, 0);
+  EXPECT_FALSE(w_p.lock());
+}
+
+TEST(shared_ptr_testing, allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  int* i_p = new int(1337);
+  {
+    shared_ptr<int> p(i_p);
+    EXPECT_EQ(*i_p, *p);
+  }
+  const size_t new_calls_after = new_calls;
+  const size_t delete_calls_after = delete_calls;
+  EXPECT_EQ(new_calls_after - new_calls_before, 2);
+  EXPECT_EQ(delete_calls_after - delete_calls_before, 2);
+}
+
+TEST(shared_ptr_testing, unique_ptr_ctor_allocations) {
+  auto u = std::make_unique<int>(1337);
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  {
+    shared_ptr<int> p(std::move(u));
+    EXPECT_EQ(1337, *p);
+    EXPECT_EQ(new_calls - new_calls_before, 1);
+  }
+  EXPECT_EQ(delete_calls - delete_calls_before, 2);
+}
+
+TEST(shared_ptr_testing, make_shared_deferred_allocations) {
+  reclaimer r;
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  make_shared_deferred<int>(r, 42);
+  EXPECT_EQ(new_calls - new_calls_before, 1);
+  EXPECT_EQ(delete_calls - delete_calls_before, 0);
+  EXPECT_EQ(1, r.drain());
+  EXPECT_EQ(delete_calls - delete_calls_before, 1);
+}
+
+TEST(shared_ptr_testing, cow_ptr_sole_owner_allocations) {
+  cow_ptr<int> c = make_cow<int>(0);
+  size_t new_calls_before = new_calls;
+  for (int i = 0; i != 100; ++i) {
+    ++c.write();
+  }
+  EXPECT_EQ(100, *c);
+  EXPECT_EQ(new_calls - new_calls_before, 0);
+  cow_ptr<int> copy = c;
+  ++c.write();
+  EXPECT_EQ(new_calls - new_calls_before, 1);
+}
+
+TEST(shared_ptr_testing, make_shared_separate_allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  weak_ptr<int> w_p;
+  {
+    shared_ptr<int> s_p = make_shared_separate<int>(42);
+    EXPECT_EQ(42, *s_p);
+    w_p = s_p;
+  }
+  EXPECT_EQ(new_calls - new_calls_before, 2);
+  EXPECT_EQ(delete_calls - delete_calls_before, 1);
+  EXPECT_FALSE(w_p.lock());
+}
+
+TEST(shared_ptr_testing, pool_allocator_reuses_blocks) {
+  // warm up the thread's free list
+  allocate_shared<int>(pool_allocator<int>(), 42);
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  for (int i = 0; i != 10; ++i) {
+    shared_ptr<int> p = allocate_shared<int>(pool_allocator<int>(), i);
+    EXPECT_EQ(i, *p);
+  }
+  EXPECT_EQ(new_calls, new_calls_before);
+  EXPECT_EQ(delete_calls, delete_calls_before);
+}
+
+TEST(shared_ptr_testing, make_shared_allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  {
+    shared_ptr<int> p = make_shared<int>(42);
+    EXPECT_EQ(42, *p);
+  }
+  const size_t new_calls_after = new_calls;
+  const size_t delete_calls_after = delete_calls;
+  EXPECT_EQ(new_calls_after - new_calls_before, 1);
+  EXPECT_EQ(delete_calls_after - delete_calls_before, 1);
+}
+
+TEST(shared_ptr_testing, make_shared_array_allocations) {
+  size_t new_calls_before = new_calls;
+  size_t delete_calls_before = delete_calls;
+  {
+    shared_ptr<int[]> p = make_shared<int[]>(1000);
+    EXPECT_EQ(0, p[999]);
+  }
+  EXPECT_EQ(new_calls - new_calls_before, 1);
+  EXPECT_EQ(delete_calls - delete_calls_before, 1);
 }
 #endif